@@ -4,12 +4,17 @@
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/LoopInfo.h"
 
 #include "corelab/Analysis/PADriver.h"
 #include "corelab/Analysis/PointerAnalysis.h"
 
 #include <set>
 #include <list>
+#include <vector>
+#include <string>
 
 namespace corelab
 {
@@ -17,6 +22,36 @@ namespace corelab
 using namespace llvm;
 using namespace std;
 
+// Memories read / written by a function and all of its callees.
+// unresolved if some access (or indirect call) can not be resolved by PA.
+struct ModRefSummary {
+	set<Value *> readSet;
+	set<Value *> writeSet;
+	bool resolved;
+
+	ModRefSummary() : resolved(true) {}
+
+	void merge(ModRefSummary &other) {
+		readSet.insert(other.readSet.begin(), other.readSet.end());
+		writeSet.insert(other.writeSet.begin(), other.writeSet.end());
+		resolved = resolved && other.resolved;
+	}
+};
+
+// Call sites found to run in parallel together, with the latency estimated
+// when they run one by one ( serial ) and all at once ( parallel ).
+struct ParallelGroup {
+	std::string name;
+	StringRef kind;
+	list<CallInst *> callInstList;
+	uint64_t serialLatency;
+	uint64_t parallelLatency;
+
+	double getSpeedup() const {
+		return parallelLatency ? (double)serialLatency / parallelLatency : 1.0;
+	}
+};
+
 class CallSiteParallelAnalysis : public ModulePass {
 	
 	public:
@@ -29,19 +64,57 @@ class CallSiteParallelAnalysis : public ModulePass {
 
 		bool runOnModule(Module& M);
 
+		void buildSummaries();
+		ModRefSummary &getSummary(CallInst *);
 		bool getUsedMemory(CallInst *, set<Value *> &);
 
-		void collectSchedule(DenseMap<Instruction *, unsigned> &, BasicBlock *);
+		bool collectAccesses(BasicBlock *, set<CallInst *> &, set<Value *> &, set<Value *> &);
+		void findBlockers(list<CallInst *> &, set<Value *> &, set<Value *> &, set<Value *> &);
+
+		bool loadLatencyTable();
+		bool loadProfileLatency();
+		uint64_t getLatency(Instruction *);
+		uint64_t collectSchedule(DenseMap<Instruction *, uint64_t> &, BasicBlock *, bool);
 		void checkBasicBlock(BasicBlock *);
 
+		// region level : call sites in control equivalent blocks of a function
+		// and innermost loops whose body is only independent call sites (DOALL)
+		bool dependsOnCall(Value *, set<CallInst *> &, set<Value *> &);
+		void checkRegion(Function *, DominatorTree &, PostDominatorTree &, LoopInfo &);
+		GetElementPtrInst *getIterationSlice(Value *, Loop *, PHINode *);
+		bool staysInSlice(Value *, int64_t, uint64_t, DenseMap<Value *, int64_t> &);
+		bool escapesFunction(Value *, Function *, set<Value *> &);
+		void checkLoop(Loop *);
+
+		void addGroup(std::string, StringRef, list<CallInst *> &, uint64_t, uint64_t);
+		void rankGroups();
+
+		const set<unsigned> &getParallelId() { return parallelId; }
+
 		unsigned getMetadata(Instruction *);
 		void makeMetadata(Instruction *);
+		void makeGroupMetadata(Instruction *, StringRef, unsigned);
 
 	private:
 		Module *module;
 		PADriverTest *pa;
 
 		set<unsigned> parallelId;
+
+		DenseMap<Function *, ModRefSummary> func2summary;
+		ModRefSummary unresolvedSummary;
+
+		// memories shared with a write between call sites of a basic block
+		DenseMap<BasicBlock *, set<Value *>> bb2blockers;
+
+		unsigned regionNum;
+		unsigned loopNum;
+
+		// latency of an instruction by opcode, of a call by its callee
+		DenseMap<unsigned, uint64_t> opcode2latency;
+		DenseMap<Function *, uint64_t> func2latency;
+
+		vector<ParallelGroup> groups;
 };
 
 }
@@ -7,6 +7,7 @@
 
 #include <set>
 #include <list>
+#include <vector>
 
 namespace corelab
 {
@@ -28,6 +29,22 @@ class Alloca2Global: public ModulePass {
 
 	private:
 		Module *module;
+
+		// shared global of one type and the functions whose allocas use it
+		struct SharedGlobal {
+			GlobalVariable *globalV;
+			set<Function *> users;
+		};
+
+		// functions each function may call ( transitively )
+		DenseMap<Function *, set<Function *>> reachable;
+		// functions that may run under a parallel call site
+		set<Function *> parallelFcns;
+
+		void promoteToRegisters(Function *);
+		void buildCallGraph();
+		bool mayBeLiveTogether(Function *, Function *);
+		GlobalVariable *createGlobal(AllocaInst *);
 };
 
 }
@@ -5,8 +5,13 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 
+#include "corelab/Analysis/PADriver.h"
+
 #include <set>
 #include <list>
+#include <map>
+#include <deque>
+#include <vector>
 
 namespace corelab
 {
@@ -14,6 +19,9 @@ namespace corelab
 using namespace llvm;
 using namespace std;
 
+// callee, and the binding of each argument ( constant / pointed memories )
+typedef pair<Function *, vector<set<Value *>>> CloneKey;
+
 class CallSitePrivatization: public ModulePass {
 	
 	public:
@@ -28,60 +36,60 @@ class CallSitePrivatization: public ModulePass {
 
 		void setAllFunction();
 		void privatizeCallInst(CallInst *);
+		bool getCloneKey(CallInst *, CloneKey &);
 		void apply2Function(Function *);
 		void apply2AllFunction();
 
 		unsigned getMetadata(Instruction *);
 		void makeMetadata(Instruction *, uint64_t);
 
-		bool isReady(Function *func) {
-			for ( auto caller : func2caller[func] )
-				if ( !func2done[caller] )
-					return false;
-			return true;
+		// A function is ready when all of its callers are done.
+		// func2pending counts the callers which are not done yet.
+		void addCaller(Function *callee, Function *caller) {
+			if ( !(func2caller[callee]).insert(caller).second )
+				return;
+			if ( func2done[caller] )
+				return;
+
+			(func2callee[caller]).push_back(callee);
+			func2pending[callee]++;
 		}
 
-		Function *getNextFunction() {
-			unsigned i = 1;
-			for ( auto func : funcSet )
-			{
-				if ( i != seed ) {
-					i++;
-					continue;
-				}
-				if ( func2done[func] )
-					continue;
-
-				addSeed();
-				return func;
-			}
-			for ( auto func : funcSet )
-			{
-				if ( func2done[func] )
-					continue;
-
-				addSeed();
-				return func;
-			}
-			return NULL;
+		void addFunction(Function *func) {
+			if ( funcSet.insert(func).second && func2pending[func] == 0 )
+				readyQueue.push_back(func);
 		}
 
-		void addSeed() {
-			unsigned size = funcSet.size();
-			if ( size == seed )
-				seed = 1;
-			else
-				seed++;
+		void setDone(Function *func) {
+			func2done[func] = true;
+			for ( auto callee : func2callee[func] )
+				if ( --func2pending[callee] == 0 && !func2done[callee] && funcSet.count(callee) )
+					readyQueue.push_back(callee);
+		}
+
+		Function *getNextFunction() {
+			if ( readyQueue.empty() )
+				return NULL;
+
+			Function *func = readyQueue.front();
+			readyQueue.pop_front();
+			return func;
 		}
 
 	private:
 		Module *module;
+		PADriverTest *pa;
 
 		set<Function *> funcSet;
 		DenseMap<Function *, bool> func2done;
 		DenseMap<Function *, set<Function *>> func2caller;
+		DenseMap<Function *, vector<Function *>> func2callee;
+		DenseMap<Function *, unsigned> func2pending;
+		deque<Function *> readyQueue;
+
+		// call sites with the same binding share one clone
+		map<CloneKey, Function *> cloneCache;
 
-		unsigned seed;
 };
 
 }
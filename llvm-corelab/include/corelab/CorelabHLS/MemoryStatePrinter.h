@@ -10,6 +10,7 @@
 #include <set>
 #include <list>
 #include <vector>
+#include <map>
 
 namespace corelab
 {
@@ -32,8 +33,12 @@ class MemoryStatePrinter : public ModulePass {
 		void setFunctions(void);
 		void apply2Functions(void);
 
-		void insertStructHandler(Type *, int, Instruction *);
-		void insertRuntime(int, Instruction *);
+		void insertStructHandler(Type *, int);
+		void addLayoutElement(int);
+		void emitLayoutTable(void);
+		void emitObjectTable(void);
+		Constant *getDumpLayout(Value *);
+		void insertStoreTrace(StoreInst *);
 
 		bool haveStruct(Type *memTy) {
 			if ( PointerType *pTy = dyn_cast<PointerType>(memTy) )
@@ -58,9 +63,10 @@ class MemoryStatePrinter : public ModulePass {
 		//Runtime Functions
 		Constant *printBits;
 		Constant *printEnd;
-		Constant *registerStruct;
-		Constant *startStruct;
-		Constant *addElement;
+		Constant *dumpMemory;
+		Constant *dumpMemoryDelta;
+		Constant *dumpEnd;
+		Constant *traceStore;
 
 	private:
 		Module *module;
@@ -69,6 +75,10 @@ class MemoryStatePrinter : public ModulePass {
 
 		DenseMap<Value *, Constant *> mem2name;
 		DenseMap<Value *, int > mem2id;
+		std::map<int, std::vector<uint32_t>> id2layout;
+		DenseMap<Value *, int > mem2objId;
+		DenseMap<Value *, Constant *> mem2dumpLayout;
+		Constant *unknownName;
 };
 
 }
@@ -2,11 +2,14 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 
 #include <set>
 #include <list>
+#include <deque>
+#include <vector>
 
 namespace corelab
 {
@@ -40,44 +43,37 @@ class ParallelCallSitePrivatization: public ModulePass {
 		void makeMetadata(Instruction *, uint64_t);
 		void makeMetadataParallel(Instruction *);
 
-		bool isReady(Function *func) {
-			for ( auto caller : func2caller[func] )
-				if ( !func2done[caller] )
-					return false;
-			return true;
+		// A function is ready when all of its callers are done.
+		// func2pending counts the callers which are not done yet.
+		void addCaller(Function *callee, Function *caller) {
+			if ( !(func2caller[callee]).insert(caller).second )
+				return;
+			if ( func2done[caller] )
+				return;
+
+			(func2callee[caller]).push_back(callee);
+			func2pending[callee]++;
 		}
 
-		Function *getNextFunction() {
-			unsigned i = 1;
-			for ( auto func : funcSet )
-			{
-				if ( i != seed ) {
-					i++;
-					continue;
-				}
-				if ( func2done[func] )
-					continue;
-
-				addSeed();
-				return func;
-			}
-			for ( auto func : funcSet )
-			{
-				if ( func2done[func] )
-					continue;
-
-				addSeed();
-				return func;
-			}
-			return NULL;
+		void addFunction(Function *func) {
+			if ( funcSet.insert(func).second && func2pending[func] == 0 )
+				readyQueue.push_back(func);
 		}
 
-		void addSeed() {
-			unsigned size = funcSet.size();
-			if ( size == seed )
-				seed = 1;
-			else
-				seed++;
+		void setDone(Function *func) {
+			func2done[func] = true;
+			for ( auto callee : func2callee[func] )
+				if ( --func2pending[callee] == 0 && !func2done[callee] && funcSet.count(callee) )
+					readyQueue.push_back(callee);
+		}
+
+		Function *getNextFunction() {
+			if ( readyQueue.empty() )
+				return NULL;
+
+			Function *func = readyQueue.front();
+			readyQueue.pop_front();
+			return func;
 		}
 
 	private:
@@ -87,13 +83,14 @@ class ParallelCallSitePrivatization: public ModulePass {
 		set<Function *> parallelFunctionSet;
 		DenseMap<Function *, bool> func2done;
 		DenseMap<Function *, set<Function *>> func2caller;
+		DenseMap<Function *, vector<Function *>> func2callee;
+		DenseMap<Function *, unsigned> func2pending;
+		deque<Function *> readyQueue;
 
 		//parallel function -> ( origin -> clone )
 		DenseMap<Function *, DenseMap<Function *, Function *>> func2origin2clone;
 
-		unsigned seed;
-
-		set<unsigned> parallelSet;
+		DenseSet<unsigned> parallelSet;
 		set<CallInst *> parallelCallSiteSet;
 
 };
@@ -6,6 +6,8 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 
+#include <vector>
+
 namespace corelab {
   using namespace llvm;
 
@@ -15,6 +17,8 @@ namespace corelab {
 
     bool runOnFunction(Function &);
     void demoteAllocasToHeap(Function &);
+    void demoteAllocasToStatic(Function &, BasicBlock *, Value *, unsigned);
+    Function *mergeRecursiveSCC(Module &, std::vector<Function *> &);
 
   public:
 
@@ -2,9 +2,11 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include <set>
 #include <list>
@@ -28,27 +30,42 @@ class InlineSmallFunction : public ModulePass {
 		bool runOnModule(Module &M);
 //		bool runOnFunction(Function &F);	
 
+		void buildCallSiteIndex();
+		void findRecursiveFunctions();
+		void updateCallSiteIndex(Function *, InlineFunctionInfo &);
+		bool verifyCallSiteIndex();
+
 		void smallFunctionSearch();
 		bool checkInlinePossible(Function *);
 		void makeInline();
 
 		bool uniqueFunctionSearch(Function *);
 
-		void updateLOC(Function *);
+		void updateCost(Function *, Function *);
 		bool recursiveCheck(Function *);
 
 		bool largeStateCheck(Function *);
 		unsigned getStateCount(Function *);
+		unsigned countHalfStates(Function *);
 		bool enoughSmall(Function *);
 		bool isNoInline(Function *);
 		bool isOptNone(Function *);
 
 		void setAttributeSize(Function *);
 
+		//Profile Guided Inline
+		bool loadProfile();
+		void profileGuidedInline();
+		void getCallSites(Function *, list<Instruction *> &);
+
 	private:
 		Module *module;
 		
 		DenseMap<Function *, unsigned> func2loc;
+		// cached naive state count of each function ( in half states )
+		DenseMap<Function *, unsigned> func2halfstate;
+		// post order of call graph SCCs ( callee first )
+		DenseMap<Function *, unsigned> func2order;
 		list<Function *> smallFunctions;
 //		list<Function *> blackList;
 		DenseMap<Function *, list<Instruction *>> func2callsite;
@@ -56,6 +73,12 @@ class InlineSmallFunction : public ModulePass {
 		list<Function *> uniqueFunctions;
 		DenseMap<Function *, unsigned> func2callsitenum;
 		DenseMap<Function *, Instruction *> func2unique;
+
+		// functions in a recursive call graph SCC
+		DenseSet<Function *> recursiveFunctions;
+
+		// measured call count of each function (from exectime)
+		DenseMap<Function *, uint64_t> func2freq;
 };
 
 }
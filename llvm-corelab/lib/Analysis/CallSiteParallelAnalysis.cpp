@@ -2,8 +2,15 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Format.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/DepthFirstIterator.h"
 
 #include "corelab/Analysis/CallSiteParallelAnalysis.h"
 #include "corelab/Utilities/GetMemOper.h"
@@ -11,12 +18,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fstream>
+#include <algorithm>
+#include <memory>
 
 using namespace llvm;
 using namespace corelab;
 
-const static bool debug = true;
-
 char CallSiteParallelAnalysis::ID = 0;
 static RegisterPass<CallSiteParallelAnalysis> X("callsite-parallel-analysis", 
 		"CallSiteParallelAnalysis", false, false);
@@ -29,79 +37,371 @@ cl::opt<bool> NoRegDep(
 		"NoRegDep", cl::init(false), cl::NotHidden,
 		cl::desc("Do not consider register dependence // pass this handling to llc"));
 
+cl::opt<std::string> LatencyFile(
+		"callsite-latency", cl::init(""), cl::NotHidden,
+		cl::desc("Per opcode latency table ( opcode name <tab> latency per line )"));
+
+cl::opt<bool> ProfileLatency(
+		"callsite-profile", cl::init(false), cl::NotHidden,
+		cl::desc("Take callee latency from exectime profile ( Function2ID.data, ExecTime.data, CallCount.data )"));
+
+cl::opt<double> ProfileMHz(
+		"callsite-profile-mhz", cl::init(100.0), cl::NotHidden,
+		cl::desc("Clock frequency in MHz converting profiled seconds into latency cycles"));
+
+cl::opt<unsigned> MinSpeedup(
+		"callsite-min-speedup", cl::init(0), cl::NotHidden,
+		cl::desc("Only mark parallel call groups whose serial latency exceeds the parallel one by this percent or more"));
+
+cl::opt<std::string> DebugDir(
+		"callsite-debug-dir", cl::init(""), cl::NotHidden,
+		cl::desc("Write the callsite_*.debug files into this directory ( off when empty )"));
+
+cl::opt<bool> RegionParallel(
+		"region-parallel", cl::init(false), cl::NotHidden,
+		cl::desc("Also find parallel call sites across control equivalent basic blocks and DOALL loops"));
+
 
 void CallSiteParallelAnalysis::getAnalysisUsage( AnalysisUsage &AU ) const
 {
 	AU.addRequired<PADriverTest>();
+	AU.addRequired<CallGraphWrapperPass>();
+	if ( RegionParallel ) {
+		AU.addRequired<DominatorTreeWrapperPass>();
+		AU.addRequired<PostDominatorTreeWrapperPass>();
+		AU.addRequired<LoopInfoWrapperPass>();
+	}
 	AU.setPreservesAll();
 }
 
-bool CallSiteParallelAnalysis::getUsedMemory(CallInst *callInst, set<Value *> &memories) {
-	Function *func = callInst->getCalledFunction();
-	assert(func);
+// Bottom up over call graph SCCs : each function is walked once.
+// Functions in a recursive SCC share one summary.
+void CallSiteParallelAnalysis::buildSummaries() {
+	CallGraph &cg = getAnalysis<CallGraphWrapperPass>().getCallGraph();
 
-	for ( auto bi = func->begin(); bi != func->end(); bi++ )
-		for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
-		{
-			Instruction *inst = &*ii;
-			if ( isa<LoadInst>(inst) || isa<StoreInst>(inst) ) {
-				Value *ptrV = getMemOper(inst);
-				set<Value *> mSet = pa->getPointedMemory(ptrV);
+	for ( scc_iterator<CallGraph *> si = scc_begin(&cg); !si.isAtEnd(); ++si )
+	{
+		set<Function *> sccFunctions;
+		for ( auto node : *si )
+			if ( Function *func = node->getFunction() )
+				sccFunctions.insert(func);
 
-				//unresolved
-				if ( mSet.size() == 0 )
-					return false;
+		if ( sccFunctions.empty() )
+			continue;
 
-				for ( auto memory : mSet )
-					memories.insert(memory);
-			}
-			else if ( CallInst *cInst = dyn_cast<CallInst>(inst) ) {
-				bool resolved = getUsedMemory(cInst, memories);
-				if ( !resolved )
-					return false;
+		ModRefSummary summary;
+
+		for ( auto func : sccFunctions )
+			for ( auto bi = func->begin(); bi != func->end(); bi++ )
+				for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
+				{
+					Instruction *inst = &*ii;
+					if ( isa<LoadInst>(inst) || isa<StoreInst>(inst) ) {
+						Value *ptrV = getMemOper(inst);
+						set<Value *> mSet = pa->getPointedMemory(ptrV);
+
+						//unresolved
+						if ( mSet.size() == 0 )
+							summary.resolved = false;
+
+						if ( isa<LoadInst>(inst) )
+							summary.readSet.insert(mSet.begin(), mSet.end());
+						else
+							summary.writeSet.insert(mSet.begin(), mSet.end());
+					}
+					else if ( CallInst *cInst = dyn_cast<CallInst>(inst) ) {
+						Function *callee = cInst->getCalledFunction();
+
+						// same SCC : the summary being built is shared
+						if ( callee && sccFunctions.count(callee) )
+							continue;
+
+						// intrinsics have no call graph edge, only memory intrinsics
+						// touch memory
+						if ( callee && callee->isIntrinsic() ) {
+							if ( MemIntrinsic *mInst = dyn_cast<MemIntrinsic>(cInst) ) {
+								set<Value *> destSet = pa->getPointedMemory(mInst->getRawDest());
+								if ( destSet.size() == 0 )
+									summary.resolved = false;
+								summary.writeSet.insert(destSet.begin(), destSet.end());
+
+								if ( MemTransferInst *tInst = dyn_cast<MemTransferInst>(mInst) ) {
+									set<Value *> srcSet = pa->getPointedMemory(tInst->getRawSource());
+									if ( srcSet.size() == 0 )
+										summary.resolved = false;
+									summary.readSet.insert(srcSet.begin(), srcSet.end());
+								}
+							}
+							continue;
+						}
+
+						if ( !callee || !func2summary.count(callee) )
+							summary.resolved = false;
+						else
+							summary.merge(func2summary[callee]);
+					}
+				}
+
+		for ( auto func : sccFunctions )
+			func2summary[func] = summary;
+
+		// sum of the critical path of its blocks; calls inside the SCC
+		// take the default call latency ( profile latency is kept )
+		DenseMap<Function *, uint64_t> sccLatency;
+		for ( auto func : sccFunctions )
+		{
+			if ( func2latency.count(func) || func->isDeclaration() )
+				continue;
+
+			uint64_t latency = 0;
+			for ( auto bi = func->begin(); bi != func->end(); bi++ )
+			{
+				DenseMap<Instruction *, uint64_t> scheduleMap;
+				latency += collectSchedule(scheduleMap, &*bi, false);
 			}
+			sccLatency[func] = latency;
 		}
+
+		for ( auto latencyIter : sccLatency )
+			func2latency[latencyIter.first] = latencyIter.second;
+	}
+}
+
+ModRefSummary &CallSiteParallelAnalysis::getSummary(CallInst *callInst) {
+	Function *func = callInst->getCalledFunction();
+	assert(func);
+
+	if ( !func2summary.count(func) )
+		return unresolvedSummary;
+
+	return func2summary[func];
+}
+
+bool CallSiteParallelAnalysis::getUsedMemory(CallInst *callInst, set<Value *> &memories) {
+	ModRefSummary &summary = getSummary(callInst);
+
+	memories.insert(summary.readSet.begin(), summary.readSet.end());
+	memories.insert(summary.writeSet.begin(), summary.writeSet.end());
+
+	return summary.resolved;
+}
+
+// opcode name <tab> latency, e.g. "fmul\t4"
+bool CallSiteParallelAnalysis::loadLatencyTable() {
+	opcode2latency.clear();
+	opcode2latency[Instruction::Load] = 1;
+	opcode2latency[Instruction::Call] = 1;
+
+	if ( LatencyFile.empty() )
+		return true;
+
+	StringMap<unsigned> name2opcode;
+	for ( unsigned opcode = 1; opcode < Instruction::OtherOpsEnd; opcode++ )
+		name2opcode[Instruction::getOpcodeName(opcode)] = opcode;
+
+	std::ifstream latencyFile(LatencyFile.c_str());
+	if ( !latencyFile.is_open() )
+		return false;
+
+	std::string line;
+	while ( getline(latencyFile, line) ) {
+		size_t pos = line.find("\t");
+		if ( pos == std::string::npos || !name2opcode.count(line.substr(0, pos)) )
+			continue;
+
+		opcode2latency[name2opcode[line.substr(0, pos)]] = std::stoull(line.substr(pos+1));
+	}
+	latencyFile.close();
+
 	return true;
 }
 
-void CallSiteParallelAnalysis::collectSchedule(
-														DenseMap<Instruction *, unsigned> &scheduleMap, BasicBlock *bb) {
+// average time of a call : accumulated execution time ( seconds ) / call count,
+// converted into cycles at -callsite-profile-mhz
+bool CallSiteParallelAnalysis::loadProfileLatency() {
+	DenseMap<int, Function *> id2func;
+	DenseMap<int, double> id2time;
+	std::string line;
+	const std::string prefix = "FunctionID ";
+
+	std::ifstream idFile("Function2ID.data");
+	if ( !idFile.is_open() )
+		return false;
+
+	while ( getline(idFile, line) ) {
+		size_t pos = line.find("\t:\t");
+		if ( pos == std::string::npos )
+			continue;
+
+		if ( Function *func = module->getFunction(line.substr(0, pos)) )
+			id2func[std::stoi(line.substr(pos+3))] = func;
+	}
+	idFile.close();
+
+	std::ifstream timeFile("ExecTime.data");
+	std::ifstream countFile("CallCount.data");
+	if ( !timeFile.is_open() || !countFile.is_open() )
+		return false;
+
+	while ( getline(timeFile, line) ) {
+		size_t pos = line.find("\t:\t");
+		if ( pos == std::string::npos || line.compare(0, prefix.size(), prefix) != 0 )
+			continue;
+
+		int id = std::stoi(line.substr(prefix.size(), pos - prefix.size()));
+		id2time[id] = std::stod(line.substr(pos+3));
+	}
+	timeFile.close();
+
+	while ( getline(countFile, line) ) {
+		size_t pos = line.find("\t:\t");
+		if ( pos == std::string::npos || line.compare(0, prefix.size(), prefix) != 0 )
+			continue;
+
+		int id = std::stoi(line.substr(prefix.size(), pos - prefix.size()));
+		uint64_t count = std::stoull(line.substr(pos+3));
+		if ( id2func.count(id) && id2time.count(id) && count != 0 )
+			func2latency[id2func[id]] = (uint64_t)(id2time[id] * ProfileMHz * 1e6 / count);
+	}
+	countFile.close();
+
+	return true;
+}
+
+uint64_t CallSiteParallelAnalysis::getLatency(Instruction *inst) {
+	if ( CallInst *callInst = dyn_cast<CallInst>(inst) ) {
+		if ( isa<DbgInfoIntrinsic>(callInst) )
+			return 0;
+
+		Function *callee = callInst->getCalledFunction();
+		if ( callee && func2latency.count(callee) )
+			return func2latency[callee];
+	}
+
+	if ( opcode2latency.count(inst->getOpcode()) )
+		return opcode2latency[inst->getOpcode()];
+	return 0;
+}
+
+// List scheduling over the data dependence DAG of a block in one pass :
+// an instruction starts when its last operand defined in the block is done.
+// serializeCalls chains each call after the previous one, i.e. the block
+// without any call site parallelism. Returns the critical path length.
+uint64_t CallSiteParallelAnalysis::collectSchedule(
+		DenseMap<Instruction *, uint64_t> &scheduleMap, BasicBlock *bb, bool serializeCalls) {
+	uint64_t criticalPath = 0;
+	uint64_t lastCallDone = 0;
+
 	for ( auto ii = bb->begin(); ii != bb->end(); ii++ )
 	{
 		Instruction *inst = &*ii;
+		uint64_t start = 0;
 
-		for ( auto  ui = inst->user_begin(); ui != inst->user_end(); ++ui )
-		{
-			Instruction *user= dyn_cast<Instruction>(*ui);
-			assert(user);
+		if ( !isa<PHINode>(inst) )
+			for ( auto &op : inst->operands() )
+			{
+				Instruction *opInst = dyn_cast<Instruction>(op.get());
+				if ( !opInst || opInst->getParent() != bb )
+					continue;
 
-			if ( user->getParent() != bb || isa<PHINode>(user) )
-				continue;
+				uint64_t done = scheduleMap[opInst] + getLatency(opInst);
+				if ( start < done )
+					start = done;
+			}
 
-			for ( auto ii2 = bb->begin(); ii2 != bb->end(); ii2++ )
-			{
-				Instruction *instIter = &*ii2;
+		bool isCall = isa<CallInst>(inst) && !isa<DbgInfoIntrinsic>(inst);
+		if ( serializeCalls && isCall && start < lastCallDone )
+			start = lastCallDone;
 
-				if ( instIter == user ) {
-					if ( isa<CallInst>(inst) || isa<LoadInst>(inst) ) {
-						if ( scheduleMap[user] < scheduleMap[inst]+1 )
-							scheduleMap[user] = scheduleMap[inst]+1;
-					}
-					else {
-						if ( scheduleMap[user] < scheduleMap[inst] )
-							scheduleMap[user] = scheduleMap[inst];
-					}
-				}
+		scheduleMap[inst] = start;
+
+		uint64_t done = start + getLatency(inst);
+		if ( isCall )
+			lastCallDone = done;
+		if ( criticalPath < done )
+			criticalPath = done;
+	}
+
+	return criticalPath;
+}
+
+bool CallSiteParallelAnalysis::collectAccesses(BasicBlock *bb, set<CallInst *> &group,
+		set<Value *> &accReads, set<Value *> &accWrites) {
+	bool resolved = true;
+
+	for ( auto ii = bb->begin(); ii != bb->end(); ii++ )
+	{
+		Instruction *inst = &*ii;
+		if ( isa<LoadInst>(inst) || isa<StoreInst>(inst) ) {
+			Value *ptrV = getMemOper(inst);
+			set<Value *> mSet = pa->getPointedMemory(ptrV);
+
+			//unresolved
+			if ( mSet.size() == 0 )
+				resolved = false;
+
+			if ( isa<LoadInst>(inst) )
+				accReads.insert(mSet.begin(), mSet.end());
+			else
+				accWrites.insert(mSet.begin(), mSet.end());
+		}
+		else if ( MemIntrinsic *memInst = dyn_cast<MemIntrinsic>(inst) ) {
+			set<Value *> dstSet = pa->getPointedMemory(memInst->getRawDest());
+			if ( dstSet.size() == 0 )
+				resolved = false;
+			accWrites.insert(dstSet.begin(), dstSet.end());
+
+			if ( MemTransferInst *transInst = dyn_cast<MemTransferInst>(memInst) ) {
+				set<Value *> srcSet = pa->getPointedMemory(transInst->getRawSource());
+				if ( srcSet.size() == 0 )
+					resolved = false;
+				accReads.insert(srcSet.begin(), srcSet.end());
+			}
+		}
+		else if ( CallInst *callInst = dyn_cast<CallInst>(inst) ) {
+			// calls out of the group are treated as plain accesses
+			if ( group.count(callInst) )
+				continue;
+
+			if ( !callInst->getCalledFunction() ) {
+				resolved = false;
+				continue;
 			}
+
+			ModRefSummary &summary = getSummary(callInst);
+			if ( !summary.resolved )
+				resolved = false;
+
+			accReads.insert(summary.readSet.begin(), summary.readSet.end());
+			accWrites.insert(summary.writeSet.begin(), summary.writeSet.end());
 		}
 	}
+
+	return resolved;
+}
+
+void CallSiteParallelAnalysis::findBlockers(list<CallInst *> &callInstList,
+		set<Value *> &accReads, set<Value *> &accWrites, set<Value *> &blockers) {
+	for ( auto callInst : callInstList )
+	{
+		ModRefSummary &summary = getSummary(callInst);
+
+		for ( auto memory : summary.writeSet )
+			if ( accReads.count(memory) || accWrites.count(memory) )
+				blockers.insert(memory);
+
+		for ( auto memory : summary.readSet )
+			if ( accWrites.count(memory) )
+				blockers.insert(memory);
+
+		accReads.insert(summary.readSet.begin(), summary.readSet.end());
+		accWrites.insert(summary.writeSet.begin(), summary.writeSet.end());
+	}
 }
 
 void CallSiteParallelAnalysis::checkBasicBlock(BasicBlock *bb) {
 	set<CallInst *> callInstSet;
 	callInstSet.clear();
-	DenseMap<CallInst *, set<Value *>> call2memories;
-	call2memories.clear();
 
 	for ( auto ii = bb->begin(); ii != bb->end(); ii++ )
 		if ( CallInst *callInst = dyn_cast<CallInst>(&*ii) )
@@ -126,29 +426,18 @@ void CallSiteParallelAnalysis::checkBasicBlock(BasicBlock *bb) {
 	errs() << "Try to Analyze " << bb->getName() << "\n";
 
 	//register dependence check
-	//check it(bb) has parallel call sites
+	//no call may take a value computed from another call of the block
 	if ( !NoRegDep ) {
-		DenseMap<Instruction *, unsigned> scheduleMap;
-		for ( auto ii = bb->begin(); ii != bb->end(); ii++ )
-			scheduleMap[&*ii] = 0;
-		collectSchedule(scheduleMap, bb);
-
-		DenseMap<unsigned, unsigned> schedule2count;
+		bool hasRegisterDependence = false;
 		for ( auto callInst : callInstSet )
 		{
-			unsigned schedule = scheduleMap[callInst];
-			if ( schedule2count.count(schedule) )
-				schedule2count[schedule] = schedule2count[schedule] + 1;
-			else
-				schedule2count[schedule] = 1;
+			set<Value *> visited;
+			for ( auto &op : callInst->arg_operands() )
+				if ( dependsOnCall(op.get(), callInstSet, visited) )
+					hasRegisterDependence = true;
 		}
 
-		bool hasParallelCall = false;
-		for ( auto scheduleIter : schedule2count)
-			if ( 1 < scheduleIter.second )
-				hasParallelCall = true;
-
-		if ( !hasParallelCall ) {
+		if ( hasRegisterDependence ) {
 			errs() << "Has Register Dependence\n\n";
 			return;
 		}
@@ -157,95 +446,610 @@ void CallSiteParallelAnalysis::checkBasicBlock(BasicBlock *bb) {
 	//memory dependence check
 	bool unresolved = false;
 	for ( auto callInst : callInstSet )
-	{
-		set<Value *> memories;
-		memories.clear();
-
-		if ( !getUsedMemory(callInst, memories) )
+		if ( !getSummary(callInst).resolved )
 			unresolved = true;
-		call2memories[callInst] = memories;
-	}
 
 	if ( unresolved ) {
 		errs() << "Unresolved\n\n";
 		return;
 	}
 
-	set<Value *> usedMemories;
-	usedMemories.clear();
+	// memories read / written so far ( basic block itself, then each call )
+	// only write-write and read-write sharing is a dependence,
+	// calls which only read a shared memory can run in parallel
+	set<Value *> accReads;
+	set<Value *> accWrites;
+	set<Value *> &blockers = bb2blockers[bb];
 
-	bool hasMemoryDependence = false;
+	bool hasMemoryDependence = !collectAccesses(bb, callInstSet, accReads, accWrites);
 
-	//in basic block
-	for ( auto ii = bb->begin(); ii != bb->end(); ii++ )
+	list<CallInst *> callInstList(callInstSet.begin(), callInstSet.end());
+	findBlockers(callInstList, accReads, accWrites, blockers);
+
+	if ( !blockers.empty() )
+		hasMemoryDependence = true;
+
+	if ( hasMemoryDependence ) {
+		errs() << "Has MemoryDependence\n";
+		for ( auto memory : blockers )
+			errs() << "\tblocked by : " << memory->getName() << "\n";
+		errs() << "\n";
+		return;
+	}
+
+	//the schedule only estimates the speedup
+	DenseMap<Instruction *, uint64_t> scheduleMap;
+	uint64_t parallelLatency = collectSchedule(scheduleMap, bb, false);
+
+	DenseMap<Instruction *, uint64_t> serialMap;
+	uint64_t serialLatency = collectSchedule(serialMap, bb, true);
+
+	errs() << "Parallel BasicBlock : " << bb->getName() << "\n\n";
+	addGroup((bb->getParent()->getName() + "\t" + bb->getName()).str(), "",
+			callInstList, serialLatency, parallelLatency);
+}
+
+static bool isMemFunction(CallInst *callInst) {
+	std::string nameStr = callInst->getCalledFunction()->getName().str();
+	nameStr.resize(11);
+	return nameStr == "corelab_mem";
+}
+
+bool CallSiteParallelAnalysis::dependsOnCall(Value *v, set<CallInst *> &callInstSet,
+		set<Value *> &visited) {
+	Instruction *inst = dyn_cast<Instruction>(v);
+	if ( !inst || !visited.insert(inst).second )
+		return false;
+
+	if ( CallInst *callInst = dyn_cast<CallInst>(inst) )
+		if ( callInstSet.count(callInst) )
+			return true;
+
+	for ( auto &op : inst->operands() )
+		if ( dependsOnCall(op.get(), callInstSet, visited) )
+			return true;
+
+	return false;
+}
+
+// Blocks A, B are control equivalent when A dominates B, B post dominates A
+// and both are in the same loop : the call sites of them run exactly once together.
+// Calls of a class are parallel when there is no register dependence between
+// them and no memory shared with a write inside the region from A to B.
+void CallSiteParallelAnalysis::checkRegion(Function *func, DominatorTree &dt,
+		PostDominatorTree &pdt, LoopInfo &li) {
+	DenseMap<BasicBlock *, BasicBlock *> bb2rep;
+	DenseMap<BasicBlock *, list<BasicBlock *>> rep2blocks;
+	list<BasicBlock *> repList;
+
+	//preorder, the representative of a class is its top block
+	for ( auto node : depth_first(dt.getRootNode()) )
 	{
-		Instruction *inst = &*ii;
-		if ( isa<LoadInst>(inst) || isa<StoreInst>(inst) ) {
-			Value *ptrV = getMemOper(inst);
-			set<Value *> mSet = pa->getPointedMemory(ptrV);
+		BasicBlock *bb = node->getBlock();
+		BasicBlock *rep = bb;
 
-			//unresolved
-			if ( mSet.size() == 0 )
+		if ( DomTreeNode *idom = node->getIDom() ) {
+			BasicBlock *candidate = bb2rep[idom->getBlock()];
+			if ( pdt.dominates(bb, candidate) && li.getLoopFor(bb) == li.getLoopFor(candidate) )
+				rep = candidate;
+		}
+
+		bb2rep[bb] = rep;
+		if ( rep == bb )
+			repList.push_back(rep);
+		rep2blocks[rep].push_back(bb);
+	}
+
+	for ( auto rep : repList )
+	{
+		list<BasicBlock *> &blocks = rep2blocks[rep];
+		if ( blocks.size() < 2 )
+			continue;
+
+		set<CallInst *> callInstSet;
+		list<CallInst *> callInstList;
+		set<BasicBlock *> callBlocks;
+		bool skip = false;
+
+		for ( auto bb : blocks )
+			for ( auto ii = bb->begin(); ii != bb->end(); ii++ )
+			{
+				CallInst *callInst = dyn_cast<CallInst>(&*ii);
+				if ( !callInst || isa<IntrinsicInst>(callInst) )
+					continue;
+
+				if ( !callInst->getCalledFunction() || (NoMF && isMemFunction(callInst)) ) {
+					skip = true;
+					continue;
+				}
+
+				callInstSet.insert(callInst);
+				callInstList.push_back(callInst);
+				callBlocks.insert(bb);
+			}
+
+		//a single block is checked by checkBasicBlock
+		if ( skip || callBlocks.size() < 2 )
+			continue;
+
+		errs() << "Try to Analyze Region " << rep->getName() << "\n";
+
+		if ( !NoRegDep ) {
+			bool hasRegisterDependence = false;
+			for ( auto callInst : callInstList )
+			{
+				set<Value *> visited;
+				for ( auto &op : callInst->arg_operands() )
+					if ( dependsOnCall(op.get(), callInstSet, visited) )
+						hasRegisterDependence = true;
+			}
+
+			if ( hasRegisterDependence ) {
+				errs() << "Has Register Dependence\n\n";
+				continue;
+			}
+		}
+
+		//every block from the top to the bottom block of the class
+		BasicBlock *tail = blocks.back();
+		set<Value *> accReads;
+		set<Value *> accWrites;
+		set<Value *> blockers;
+
+		bool hasMemoryDependence = false;
+		for ( auto bi = func->begin(); bi != func->end(); bi++ )
+			if ( dt.dominates(rep, &*bi) && pdt.dominates(tail, &*bi) )
+				if ( !collectAccesses(&*bi, callInstSet, accReads, accWrites) )
+					hasMemoryDependence = true;
+
+		for ( auto callInst : callInstList )
+			if ( !getSummary(callInst).resolved )
 				hasMemoryDependence = true;
 
-			for ( auto memory : mSet )
-				usedMemories.insert(memory);
+		findBlockers(callInstList, accReads, accWrites, blockers);
+
+		if ( !blockers.empty() )
+			hasMemoryDependence = true;
+
+		if ( hasMemoryDependence ) {
+			errs() << "Has MemoryDependence\n";
+			for ( auto memory : blockers )
+				errs() << "\tblocked by : " << memory->getName() << "\n";
+			errs() << "\n";
+			continue;
 		}
+
+		//no register dependence between them : all calls start together
+		uint64_t serialLatency = 0;
+		uint64_t parallelLatency = 0;
+		for ( auto callInst : callInstList )
+		{
+			uint64_t latency = getLatency(callInst);
+			serialLatency += latency;
+			parallelLatency = std::max(parallelLatency, latency);
+		}
+
+		errs() << "Parallel Region : " << rep->getName() << " ~ " << tail->getName() << "\n\n";
+		addGroup((func->getName() + "\t" + rep->getName() + "~" + tail->getName()).str(),
+				"parallel.region", callInstList, serialLatency, parallelLatency);
 	}
+}
 
-	for ( auto callInst : callInstSet )
+// getelementptr base, ( constants ), iv, ( constants ) with a loop invariant base :
+// each iteration hands a distinct aggregate element to the callee.
+// a pointer to a scalar element may be indexed beyond it, so it is not private.
+GetElementPtrInst *CallSiteParallelAnalysis::getIterationSlice(Value *v, Loop *loop,
+		PHINode *indVar) {
+	GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(v->stripPointerCasts());
+	if ( !gep || !loop->isLoopInvariant(gep->getPointerOperand()) )
+		return NULL;
+
+	unsigned indVarNum = 0;
+	for ( auto idx = gep->idx_begin(); idx != gep->idx_end(); idx++ )
+	{
+		Value *idxV = idx->get();
+		if ( isa<ConstantInt>(idxV) )
+			continue;
+
+		//a truncated iv wraps around, two iterations may share an element
+		if ( CastInst *castInst = dyn_cast<CastInst>(idxV) ) {
+			if ( !isa<SExtInst>(castInst) && !isa<ZExtInst>(castInst) )
+				return NULL;
+			idxV = castInst->getOperand(0);
+		}
+
+		if ( idxV != indVar )
+			return NULL;
+		indVarNum++;
+	}
+
+	if ( indVarNum != 1 || !gep->getResultElementType()->isAggregateType() )
+		return NULL;
+
+	return gep;
+}
+
+// true if every access through v, offset bytes into a slice, stays in
+// [0, size) of it : followed through constant geps, casts and callees.
+bool CallSiteParallelAnalysis::staysInSlice(Value *v, int64_t offset, uint64_t size,
+		DenseMap<Value *, int64_t> &visited) {
+	if ( visited.count(v) )
+		return visited[v] == offset;
+	visited[v] = offset;
+
+	const DataLayout &DL = module->getDataLayout();
+	for ( auto user : v->users() )
+	{
+		uint64_t width = 0;
+
+		if ( LoadInst *loadInst = dyn_cast<LoadInst>(user) )
+			width = DL.getTypeStoreSize(loadInst->getType());
+		else if ( StoreInst *storeInst = dyn_cast<StoreInst>(user) ) {
+			if ( storeInst->getValueOperand() == v )
+				return false;
+			width = DL.getTypeStoreSize(storeInst->getValueOperand()->getType());
+		}
+		else if ( GEPOperator *gep = dyn_cast<GEPOperator>(user) ) {
+			APInt gepOffset(DL.getIndexSizeInBits(gep->getPointerAddressSpace()), 0);
+			if ( !gep->accumulateConstantOffset(DL, gepOffset)
+					|| !staysInSlice(gep, offset + gepOffset.getSExtValue(), size, visited) )
+				return false;
+			continue;
+		}
+		else if ( Operator::getOpcode(user) == Instruction::BitCast ) {
+			if ( !staysInSlice(user, offset, size, visited) )
+				return false;
+			continue;
+		}
+		else if ( isa<DbgInfoIntrinsic>(user) || isa<CmpInst>(user) )
+			continue;
+		else if ( MemIntrinsic *memInst = dyn_cast<MemIntrinsic>(user) ) {
+			ConstantInt *length = dyn_cast<ConstantInt>(memInst->getLength());
+			if ( !length )
+				return false;
+			width = length->getZExtValue();
+		}
+		else if ( CallInst *callInst = dyn_cast<CallInst>(user) ) {
+			Function *callee = callInst->getCalledFunction();
+			if ( !callee || callee->isDeclaration() || callee->isVarArg()
+					|| callInst->getCalledValue() == v )
+				return false;
+
+			for ( auto &op : callInst->arg_operands() )
+				if ( op.get() == v ) {
+					Argument *arg = &*std::next(callee->arg_begin(), op.getOperandNo());
+					if ( !staysInSlice(arg, offset, size, visited) )
+						return false;
+				}
+			continue;
+		}
+		else
+			return false;
+
+		if ( offset < 0 || size < offset + width )
+			return false;
+	}
+
+	return true;
+}
+
+// true if the address of a memory may reach a callee other than as an argument
+bool CallSiteParallelAnalysis::escapesFunction(Value *v, Function *func,
+		set<Value *> &visited) {
+	if ( !visited.insert(v).second )
+		return false;
+
+	for ( auto user : v->users() )
 	{
-		callInst->dump();
-		for ( auto memory : call2memories[callInst] )
+		if ( Instruction *inst = dyn_cast<Instruction>(user) ) {
+			if ( inst->getFunction() != func )
+				return true;
+
+			if ( StoreInst *storeInst = dyn_cast<StoreInst>(inst) ) {
+				if ( storeInst->getValueOperand() == v )
+					return true;
+				continue;
+			}
+
+			if ( isa<LoadInst>(inst) || isa<CmpInst>(inst) )
+				continue;
+
+			//derived pointers ( call : may return its argument )
+			if ( escapesFunction(inst, func, visited) )
+				return true;
+		}
+		else if ( ConstantExpr *constExpr = dyn_cast<ConstantExpr>(user) ) {
+			if ( escapesFunction(constExpr, func, visited) )
+				return true;
+		}
+		else
+			return true;
+	}
+
+	return false;
+}
+
+// DOALL : an innermost loop with a canonical induction variable whose body is
+// only call sites and address / control computation. A memory written by a call
+// must reach every call using it through the same iteration private slice.
+void CallSiteParallelAnalysis::checkLoop(Loop *loop) {
+	if ( !loop->getSubLoops().empty() )
+		return;
+
+	PHINode *indVar = loop->getCanonicalInductionVariable();
+	if ( !indVar )
+		return;
+
+	BasicBlock *header = loop->getHeader();
+	Function *func = header->getParent();
+	list<CallInst *> callInstList;
+
+	for ( auto bb : loop->blocks() )
+		for ( auto ii = bb->begin(); ii != bb->end(); ii++ )
 		{
-			memory->dump();
-			if ( usedMemories.find(memory) != usedMemories.end() ) {
-				hasMemoryDependence = true;
-				errs() << "here\n";
+			Instruction *inst = &*ii;
+
+			if ( PHINode *phi = dyn_cast<PHINode>(inst) ) {
+				//other recurrence : loop carried register dependence
+				if ( bb == header && phi != indVar )
+					return;
 			}
-			else
-				usedMemories.insert(memory);
+			else if ( isa<DbgInfoIntrinsic>(inst) )
+				continue;
+			else if ( CallInst *callInst = dyn_cast<CallInst>(inst) ) {
+				Function *callee = callInst->getCalledFunction();
+				if ( !callee || callee->isDeclaration() || (NoMF && isMemFunction(callInst)) )
+					return;
+				callInstList.push_back(callInst);
+			}
+			else if ( !isa<BranchInst>(inst) && !isa<CmpInst>(inst) && !isa<BinaryOperator>(inst)
+					&& !isa<CastInst>(inst) && !isa<GetElementPtrInst>(inst) )
+				return;
 		}
-		errs() << "\n";
+
+	if ( callInstList.empty() )
+		return;
+
+	errs() << "Try to Analyze Loop " << header->getName() << "\n";
+
+	//calls of an iteration must not feed each other nor the loop control
+	set<CallInst *> callInstSet(callInstList.begin(), callInstList.end());
+	bool hasRegisterDependence = false;
+	for ( auto callInst : callInstList )
+	{
+		set<Value *> visited;
+		for ( auto &op : callInst->arg_operands() )
+			if ( dependsOnCall(op.get(), callInstSet, visited) )
+				hasRegisterDependence = true;
 	}
 
-	if ( hasMemoryDependence ) {
-		errs() << "Has MemoryDependence\n\n";
+	for ( auto bb : loop->blocks() )
+	{
+		set<Value *> visited;
+		if ( dependsOnCall(bb->getTerminator(), callInstSet, visited) )
+			hasRegisterDependence = true;
+	}
+
+	if ( hasRegisterDependence ) {
+		errs() << "Has Register Dependence\n\n";
 		return;
 	}
 
-	errs() << "Parallel BasicBlock : " << bb->getName() << "\n";
-	for ( auto callInst : callInstSet )
+	set<Value *> writeSet;
+	for ( auto callInst : callInstList )
+	{
+		ModRefSummary &summary = getSummary(callInst);
+		if ( !summary.resolved ) {
+			errs() << "Unresolved\n\n";
+			return;
+		}
+		writeSet.insert(summary.writeSet.begin(), summary.writeSet.end());
+	}
+
+	set<Value *> blockers;
+
+	for ( auto memory : writeSet )
 	{
-		unsigned callId = getMetadata(callInst);
-		errs() << *callInst << " : " << callId << "\n";
+		AllocaInst *allocaInst = dyn_cast<AllocaInst>(memory);
+		set<Value *> visited;
+		if ( !(isa<GlobalVariable>(memory) || (allocaInst && allocaInst->getFunction() == func))
+				|| escapesFunction(memory, func, visited) ) {
+			blockers.insert(memory);
+			continue;
+		}
 
-		parallelId.insert(callId);
+		GetElementPtrInst *slice = NULL;
+		for ( auto callInst : callInstList )
+		{
+			ModRefSummary &summary = getSummary(callInst);
+			if ( !summary.readSet.count(memory) && !summary.writeSet.count(memory) )
+				continue;
 
-		makeMetadata(callInst);
+			bool passed = false;
+			for ( auto &op : callInst->arg_operands() )
+			{
+				Value *arg = op.get();
+				if ( !arg->getType()->isPointerTy() || !pa->getPointedMemory(arg).count(memory) )
+					continue;
+
+				//the callee must stay inside the element of its iteration
+				GetElementPtrInst *gep = getIterationSlice(arg, loop, indVar);
+				if ( gep ) {
+					Function *callee = callInst->getCalledFunction();
+					uint64_t size = module->getDataLayout().getTypeAllocSize(gep->getResultElementType());
+					DenseMap<Value *, int64_t> visited;
+					if ( callee->isVarArg() || !staysInSlice(&*std::next(callee->arg_begin(),
+								op.getOperandNo()), 0, size, visited) )
+						gep = NULL;
+				}
+				if ( !gep || (slice && !slice->isIdenticalTo(gep)) )
+					blockers.insert(memory);
+				slice = gep;
+				passed = true;
+			}
+
+			//reached through an other pointer than its arguments
+			if ( !passed )
+				blockers.insert(memory);
+		}
+	}
+
+	if ( !blockers.empty() ) {
+		errs() << "Has Loop Carried MemoryDependence\n";
+		for ( auto memory : blockers )
+			errs() << "\tblocked by : " << memory->getName() << "\n";
+		errs() << "\n";
+		return;
 	}
-	errs() << "\n\n";
+
+	//estimated as two iterations overlapped, the least a private copy of the body gives
+	uint64_t bodyLatency = 0;
+	for ( auto callInst : callInstList )
+		bodyLatency += getLatency(callInst);
+
+	errs() << "DOALL Loop : " << header->getName() << "\n\n";
+	addGroup((func->getName() + "\t" + header->getName()).str(), "doall",
+			callInstList, 2 * bodyLatency, bodyLatency);
+}
+
+void CallSiteParallelAnalysis::addGroup(std::string name, StringRef kind,
+		list<CallInst *> &callInstList, uint64_t serialLatency, uint64_t parallelLatency) {
+	ParallelGroup group;
+	group.name = name;
+	group.kind = kind;
+	group.callInstList = callInstList;
+	group.serialLatency = serialLatency;
+	group.parallelLatency = parallelLatency;
+	groups.push_back(group);
+}
+
+// Groups ordered by saved latency; the ones expected to speed up less
+// than MinSpeedup are left sequential, privatizing them only costs area.
+void CallSiteParallelAnalysis::rankGroups() {
+	std::stable_sort(groups.begin(), groups.end(),
+			[](const ParallelGroup &first, const ParallelGroup &second) {
+				return ( first.serialLatency - first.parallelLatency
+					> second.serialLatency - second.parallelLatency );
+			});
+
+	std::error_code ec_print = std::make_error_code(std::errc::io_error);
+	std::unique_ptr<raw_fd_ostream> rankFile;
+	if ( !DebugDir.empty() )
+		rankFile.reset(new raw_fd_ostream(DebugDir + "/callsite_rank.debug", ec_print, llvm::sys::fs::F_None));
+
+	for ( auto &group : groups )
+	{
+		bool accepted = (group.getSpeedup() - 1) * 100 >= MinSpeedup;
+
+		if ( rankFile )
+			*rankFile << group.name << "\t" << group.serialLatency << "\t" << group.parallelLatency
+				<< "\t" << format("%.2f", group.getSpeedup()) << ( accepted ? "" : "\tskipped" ) << "\n";
+
+		if ( !accepted )
+			continue;
+
+		unsigned groupId = 0;
+		if ( group.kind == "parallel.region" )
+			groupId = regionNum++;
+		else if ( group.kind == "doall" )
+			groupId = loopNum++;
+
+		errs() << "Parallel Group : " << group.name << " ( x" << format("%.2f", group.getSpeedup()) << " )\n";
+		for ( auto callInst : group.callInstList )
+		{
+			unsigned callId = getMetadata(callInst);
+			errs() << *callInst << " : " << callId << "\n";
+
+			parallelId.insert(callId);
+
+			makeMetadata(callInst);
+			if ( !group.kind.empty() )
+				makeGroupMetadata(callInst, group.kind, groupId);
+		}
+		errs() << "\n\n";
+	}
+
+	if ( rankFile )
+		rankFile->close();
 }
 
 bool CallSiteParallelAnalysis::runOnModule(Module& M) {
 	module = &M;
 	pa = getAnalysis<PADriverTest>().getPA();
 
+	if ( !loadLatencyTable() )
+		errs() << "Can not find latency table ( " << LatencyFile << " ), use default latency\n";
+
+	func2latency.clear();
+	if ( ProfileLatency && !loadProfileLatency() )
+		errs() << "Can not find exectime profile, use summary latency\n";
+
+	unresolvedSummary.resolved = false;
+	func2summary.clear();
+	bb2blockers.clear();
+	buildSummaries();
+
 	parallelId.clear();
+	groups.clear();
+	regionNum = 0;
+	loopNum = 0;
 	for ( auto fi = module->begin(); fi != module->end(); fi++ )
 	{
 		errs() << "Function : " << (&*fi)->getName() << "\n";
 		for ( auto bi = (&*fi)->begin(); bi != (&*fi)->end(); bi++ )
 			checkBasicBlock(&*bi);
+
+		if ( RegionParallel && !(&*fi)->isDeclaration() ) {
+			Function *func = &*fi;
+			DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>(*func).getDomTree();
+			PostDominatorTree &pdt = getAnalysis<PostDominatorTreeWrapperPass>(*func).getPostDomTree();
+			LoopInfo &li = getAnalysis<LoopInfoWrapperPass>(*func).getLoopInfo();
+
+			checkRegion(func, dt, pdt, li);
+			for ( auto loop : li.getLoopsInPreorder() )
+				checkLoop(loop);
+		}
 	}
 
-	std::error_code ec_print = std::make_error_code(std::errc::io_error);
-	raw_fd_ostream parallelFile("callsite_parallel.debug", ec_print, llvm::sys::fs::F_None);
+	rankGroups();
 
+	//handed over to ParallelCallSitePrivatization in the module itself
+	NamedMDNode *idMDNode = module->getOrInsertNamedMetadata("corelab.parallel.callsite");
+	idMDNode->clearOperands();
 	for ( auto id : parallelId )
-		parallelFile << id << "\n";
+	{
+		Constant *IdV = ConstantInt::get(Type::getInt64Ty(module->getContext()), id);
+		Metadata *valuesArray[] = {(Metadata *)ConstantAsMetadata::get(IdV)};
+		idMDNode->addOperand(MDNode::get(module->getContext(), valuesArray));
+	}
+
+	std::error_code ec_print = std::make_error_code(std::errc::io_error);
+	if ( !DebugDir.empty() ) {
+		raw_fd_ostream parallelFile(DebugDir + "/callsite_parallel.debug", ec_print, llvm::sys::fs::F_None);
+
+		for ( auto id : parallelId )
+			parallelFile << id << "\n";
+
+		parallelFile.close();
+	}
+
+	//memories which keep call sites in a basic block from running in parallel
+	if ( !DebugDir.empty() ) {
+		raw_fd_ostream conflictFile(DebugDir + "/callsite_conflict.debug", ec_print, llvm::sys::fs::F_None);
 
-	parallelFile.close();
+		for ( auto fi = module->begin(); fi != module->end(); fi++ )
+			for ( auto bi = (&*fi)->begin(); bi != (&*fi)->end(); bi++ )
+			{
+				if ( !bb2blockers.count(&*bi) )
+					continue;
+
+				for ( auto memory : bb2blockers[&*bi] )
+					conflictFile << (&*fi)->getName() << "\t" << (&*bi)->getName()
+						<< "\t" << memory->getName() << "\n";
+			}
+
+		conflictFile.close();
+	}
 
 	return true;
 }
@@ -277,3 +1081,16 @@ void CallSiteParallelAnalysis::makeMetadata(Instruction* instruction) {
 	instruction->setMetadata("parallel", mdNode);
 }
 
+// group id of a parallel region / DOALL loop, "parallel" alone does not tell
+// which call sites run together once they are spread over blocks
+void CallSiteParallelAnalysis::makeGroupMetadata(Instruction* instruction, StringRef kind, unsigned groupId) {
+	LLVMContext &context = instruction->getModule()->getContext();
+	Constant* IdV = ConstantInt::get(Type::getInt64Ty(context), groupId);
+	Metadata* IdM = (Metadata*)ConstantAsMetadata::get(IdV);
+	Metadata* valuesArray[] = {IdM};
+	ArrayRef<Metadata *> values(valuesArray, 1);
+	MDNode* mdNode = MDNode::get(context, values);
+	NamedMDNode *namedMDNode = module->getOrInsertNamedMetadata(("corelab." + kind).str());
+	namedMDNode->addOperand(mdNode);
+	instruction->setMetadata(kind, mdNode);
+}
@@ -3,20 +3,45 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "corelab/CorelabHLS/Alloca2Global.h"
 
-#include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+
+#include <map>
 
 using namespace llvm;
 using namespace corelab;
 
 const static bool debug = true;
 
+static cl::opt<bool> ShareAlloca(
+		"alloca-share", cl::init(false), cl::NotHidden,
+		cl::desc("Let allocas of functions never live at the same time share a global"));
+
+static cl::opt<bool> PromoteAlloca(
+		"alloca-promote", cl::init(false), cl::NotHidden,
+		cl::desc("Keep promotable allocas in registers, only arrays, structs and address taken allocas become globals"));
+
+static cl::opt<std::string> Id2MemoryInfo(
+		"id2memory-info", cl::init("id2memory.info"), cl::NotHidden,
+		cl::desc("Text map of memory ids to allocas ( empty : not written )"));
+
+static cl::opt<std::string> Id2MemoryMap(
+		"id2memory-map", cl::init(""), cl::NotHidden,
+		cl::desc("Binary map of memory ids to allocas"));
+
 char Alloca2Global::ID = 0;
 static RegisterPass<Alloca2Global> X("alloca-global", 
 		"Alloca to Global Variable", false, false);
@@ -26,18 +51,295 @@ void Alloca2Global::getAnalysisUsage( AnalysisUsage &AU ) const
 	AU.setPreservesAll();
 }
 
-static int id;
+// Binary id2memory map
+//   header : magic "CLIM", version, numOfEntries ( uint32_t each )
+//   entry  : id ( uint64_t ), functionLength, nameLength ( uint32_t ),
+//            function name, alloca name
+#define ID2MEMORY_MAGIC 0x4d494c43
+#define ID2MEMORY_VERSION 1
+
+struct MemoryEntry {
+	uint64_t id;
+	std::string function;
+	std::string name;
+};
+
+// Stable id of an alloca : MD5 of its function name, its name and its type,
+// so ids do not move when other code of the module changes. The ordinal among
+// allocas with the same key tells duplicates apart.
+static uint64_t getMemoryID(AllocaInst *aInst, StringMap<unsigned> &keyCount) {
+	std::string key;
+	raw_string_ostream keyStream(key);
+	keyStream << aInst->getFunction()->getName() << '\0' << aInst->getName()
+		<< '\0' << *aInst->getAllocatedType();
+	keyStream.flush();
+
+	unsigned ordinal = keyCount[key]++;
+	key += '\0';
+	key += utostr(ordinal);
+	return MD5Hash(key);
+}
+
+template <typename T>
+static void writeBinary(raw_ostream &out, T value) {
+	out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static void writeMemoryMap(const vector<MemoryEntry> &entries) {
+	if ( !Id2MemoryInfo.empty() ) {
+		std::error_code ec;
+		raw_fd_ostream infoFile(Id2MemoryInfo, ec, llvm::sys::fs::F_Text);
+		for ( auto &entry : entries )
+			infoFile << entry.id << "\t" << entry.name << "\n";
+	}
+
+	if ( !Id2MemoryMap.empty() ) {
+		std::error_code ec;
+		raw_fd_ostream mapFile(Id2MemoryMap, ec, llvm::sys::fs::F_None);
+		if ( ec ) {
+			errs() << "Alloca2Global : can not open " << Id2MemoryMap << " : " << ec.message() << "\n";
+			return;
+		}
+
+		writeBinary<uint32_t>(mapFile, ID2MEMORY_MAGIC);
+		writeBinary<uint32_t>(mapFile, ID2MEMORY_VERSION);
+		writeBinary<uint32_t>(mapFile, entries.size());
+		for ( auto &entry : entries )
+		{
+			writeBinary<uint64_t>(mapFile, entry.id);
+			writeBinary<uint32_t>(mapFile, entry.function.size());
+			writeBinary<uint32_t>(mapFile, entry.name.size());
+			mapFile << entry.function << entry.name;
+		}
+	}
+}
+
+
+// every use is an inbounds gep with constant indices ( first 0, array
+// indices within the array ) down to a scalar, used only as the address
+// of loads and stores
+static bool isScalarizable(AllocaInst *aInst) {
+	Type *allocaType = aInst->getAllocatedType();
+	if ( !allocaType->isAggregateType() || aInst->isArrayAllocation() )
+		return false;
+
+	for ( auto user : aInst->users() )
+	{
+		GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(user);
+		if ( !gep || gep->getPointerOperand() != aInst || !gep->hasAllConstantIndices()
+				|| !gep->isInBounds() )
+			return false;
+
+		// an index out of its array aliases an other element ( or none )
+		for ( auto gti = gep_type_begin(gep); gti != gep_type_end(gep); ++gti )
+		{
+			if ( !gti.isBoundedSequential() )
+				continue;
+
+			ConstantInt *idx = cast<ConstantInt>(gti.getOperand());
+			if ( idx->isNegative() || idx->getZExtValue() >= gti.getSequentialNumElements() )
+				return false;
+		}
+
+		ConstantInt *first = dyn_cast<ConstantInt>(gep->getOperand(1));
+		if ( !first || !first->isZero() || !gep->getResultElementType()->isSingleValueType() )
+			return false;
+
+		for ( auto gepUser : gep->users() )
+		{
+			if ( LoadInst *lInst = dyn_cast<LoadInst>(gepUser) ) {
+				if ( lInst->isVolatile() )
+					return false;
+			}
+			else if ( StoreInst *sInst = dyn_cast<StoreInst>(gepUser) ) {
+				if ( sInst->isVolatile() || sInst->getValueOperand() == gep )
+					return false;
+			}
+			else
+				return false;
+		}
+	}
+	return true;
+}
+
+// one scalar alloca per element the constant geps touch
+static void scalarize(AllocaInst *aInst) {
+	map<vector<uint64_t>, AllocaInst *> element2alloca;
+	vector<GetElementPtrInst *> geps;
+
+	for ( auto user : aInst->users() )
+		geps.push_back(cast<GetElementPtrInst>(user));
+
+	for ( auto gep : geps )
+	{
+		vector<uint64_t> indices;
+		for ( auto idx = gep->idx_begin(); idx != gep->idx_end(); ++idx )
+			indices.push_back(cast<ConstantInt>(idx->get())->getZExtValue());
+
+		AllocaInst *&element = element2alloca[indices];
+		if ( !element )
+			element = new AllocaInst(gep->getResultElementType(), aInst->getType()->getAddressSpace(),
+					aInst->getName() + ".scalar", aInst);
+
+		gep->replaceAllUsesWith(element);
+		gep->eraseFromParent();
+	}
+
+	aInst->eraseFromParent();
+}
+
+// mem2reg after splitting constant indexed aggregates, what stays an alloca
+// is an array, a struct or has its address taken
+void Alloca2Global::promoteToRegisters(Function *F) {
+	BasicBlock &entryBB = F->getEntryBlock();
+
+	vector<AllocaInst *> aggregates;
+	for ( auto ii = entryBB.begin(); ii != entryBB.end(); ii++ )
+		if ( AllocaInst *aInst = dyn_cast<AllocaInst>(&*ii) )
+			if ( isScalarizable(aInst) )
+				aggregates.push_back(aInst);
+
+	for ( auto aInst : aggregates )
+		scalarize(aInst);
+
+	vector<AllocaInst *> promotable;
+	for ( auto ii = entryBB.begin(); ii != entryBB.end(); ii++ )
+		if ( AllocaInst *aInst = dyn_cast<AllocaInst>(&*ii) )
+			if ( isAllocaPromotable(aInst) )
+				promotable.push_back(aInst);
+
+	if ( promotable.empty() )
+		return;
+
+	DominatorTree DT(*F);
+	PromoteMemToReg(promotable, DT);
+}
+
+// direct callees closed transitively, an indirect call may reach every
+// function with a body and an external function every address taken one
+// ( a callback handed to it )
+void Alloca2Global::buildCallGraph() {
+	DenseMap<Function *, set<Function *>> callees;
+	set<Function *> parallelRoots;
+
+	set<Function *> addressTaken;
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+		if ( !fi->isDeclaration() && fi->hasAddressTaken() )
+			addressTaken.insert(&*fi);
+
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+	{
+		Function *F = &*fi;
+		set<Function *> &fCallees = callees[F];
+
+		for ( auto bi = F->begin(); bi != F->end(); bi++ )
+			for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
+			{
+				CallSite cs(&*ii);
+				if ( !cs.getInstruction() ) continue;
+
+				Function *callee = dyn_cast<Function>(cs.getCalledValue()->stripPointerCasts());
+				if ( callee && callee->isIntrinsic() ) continue;
+
+				set<Function *> targets;
+				if ( callee && callee->isDeclaration() )
+					targets = addressTaken;
+				else if ( callee )
+					targets.insert(callee);
+				else
+					for ( auto ci = module->begin(); ci != module->end(); ci++ )
+						if ( !ci->isDeclaration() )
+							targets.insert(&*ci);
+
+				fCallees.insert(targets.begin(), targets.end());
+				if ( (&*ii)->getMetadata("parallel") )
+					parallelRoots.insert(targets.begin(), targets.end());
+			}
+	}
+
+	reachable.clear();
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+	{
+		set<Function *> &visited = reachable[&*fi];
+		list<Function *> worklist(callees[&*fi].begin(), callees[&*fi].end());
+
+		while ( !worklist.empty() ) {
+			Function *F = worklist.front();
+			worklist.pop_front();
+
+			if ( !visited.insert(F).second ) continue;
+			worklist.insert(worklist.end(), callees[F].begin(), callees[F].end());
+		}
+	}
+
+	parallelFcns.clear();
+	for ( auto F : parallelRoots )
+	{
+		parallelFcns.insert(F);
+		parallelFcns.insert(reachable[F].begin(), reachable[F].end());
+	}
+}
+
+// Frames of two functions coexist only when one is on the call chain of the
+// other, or both can run under parallel call sites.
+bool Alloca2Global::mayBeLiveTogether(Function *F1, Function *F2) {
+	if ( F1 == F2 )
+		return true;
+	if ( reachable[F1].count(F2) || reachable[F2].count(F1) )
+		return true;
+	return parallelFcns.count(F1) && parallelFcns.count(F2);
+}
+
+GlobalVariable *Alloca2Global::createGlobal(AllocaInst *aInst) {
+	Type *allocaType = aInst->getType()->getElementType();
+
+	GlobalVariable *globalV = NULL;
 
-static int getID(void) { return ++id; }
+	if ( allocaType->isStructTy() || allocaType->isArrayTy() || allocaType->isVectorTy() ){
+		globalV = new GlobalVariable(*module, 
+				aInst->getType()->getElementType(), false, GlobalValue::CommonLinkage,
+				ConstantAggregateZero::get(allocaType), aInst->getName()); 
+	}
+	else if ( allocaType->isPointerTy() ) {
+		globalV = new GlobalVariable(*module, 
+				aInst->getType()->getElementType(), false, GlobalValue::CommonLinkage,
+				ConstantPointerNull::get(dyn_cast<PointerType>(allocaType))); 
+	}
+	else {
+		globalV = new GlobalVariable(*module, 
+				aInst->getType()->getElementType(), false, GlobalValue::CommonLinkage,
+				ConstantInt::get(allocaType, 0)); 
+	}
 
+	assert(globalV);
+	return globalV;
+}
 
 bool Alloca2Global::runOnModule(Module& M) {
 	module = &M;
 
-	std::error_code ec_print = std::make_error_code(std::errc::io_error);
-	raw_fd_ostream refFile("id2memory.info", ec_print, llvm::sys::fs::F_None);
+	LLVMContext &ctx = module->getContext();
+	StringMap<unsigned> keyCount;
+	vector<MemoryEntry> entries;
+	// ids of the allocas each global holds, in module order
+	DenseMap<GlobalVariable *, vector<Metadata *>> global2ids;
+	vector<GlobalVariable *> globals;
+
+	if ( PromoteAlloca )
+		for ( auto fi = module->begin(); fi != module->end(); fi++ )
+			if ( !fi->isDeclaration() )
+				promoteToRegisters(&*fi);
+
+	if ( ShareAlloca )
+		buildCallGraph();
 
-	id = 0;
+	// allocated type -> globals allocas of that type may share
+	DenseMap<Type *, vector<SharedGlobal>> sharedGlobals;
+	const DataLayout &DL = module->getDataLayout();
+	uint64_t allocaBytes = 0;
+	uint64_t globalBytes = 0;
+	unsigned numOfAllocas = 0;
+	unsigned numOfGlobals = 0;
 
 	set<Instruction *> erasedSet;
 	erasedSet.clear();
@@ -53,32 +355,56 @@ bool Alloca2Global::runOnModule(Module& M) {
 //					StringRef tmp_name("this_is_tmp");
 //					aInst->setName(tmp_name);
 
-					refFile << getID() << "\t" << aInst->getName() << "\n";
-					char str[30];
-					sprintf(str, "REF_%d_REF", id);
+					MemoryEntry entry;
+					entry.id = getMemoryID(aInst, keyCount);
+					entry.function = fi->getName();
+					entry.name = aInst->getName();
+					entries.push_back(entry);
 
 					Type *allocaType = aInst->getType()->getElementType();
+					Function *F = &*fi;
+					uint64_t size = DL.getTypeAllocSize(allocaType);
 
 					GlobalVariable *globalV = NULL;
 
 					aInst->dump();
-					if ( allocaType->isStructTy() || allocaType->isArrayTy() || allocaType->isVectorTy() ){
-						globalV = new GlobalVariable(*module, 
-								aInst->getType()->getElementType(), false, GlobalValue::CommonLinkage,
-								ConstantAggregateZero::get(allocaType), aInst->getName()); 
-					}
-					else if ( allocaType->isPointerTy() ) {
-						globalV = new GlobalVariable(*module, 
-								aInst->getType()->getElementType(), false, GlobalValue::CommonLinkage,
-								ConstantPointerNull::get(dyn_cast<PointerType>(allocaType))); 
-					}
-					else {
-						globalV = new GlobalVariable(*module, 
-								aInst->getType()->getElementType(), false, GlobalValue::CommonLinkage,
-								ConstantInt::get(allocaType, 0)); 
+					bool shareable = ShareAlloca && !aInst->isArrayAllocation();
+					if ( shareable )
+						for ( auto &shared : sharedGlobals[allocaType] )
+						{
+							bool interfere = false;
+							for ( auto user : shared.users )
+								if ( mayBeLiveTogether(user, F) ) {
+									interfere = true;
+									break;
+								}
+
+							if ( interfere ) continue;
+
+							globalV = shared.globalV;
+							shared.users.insert(F);
+							break;
+						}
+
+					if ( !globalV ) {
+						globalV = createGlobal(aInst);
+						globals.push_back(globalV);
+						globalBytes += size;
+						numOfGlobals++;
+
+						if ( shareable ) {
+							SharedGlobal shared;
+							shared.globalV = globalV;
+							shared.users.insert(F);
+							sharedGlobals[allocaType].push_back(shared);
+						}
 					}
+					allocaBytes += size;
+					numOfAllocas++;
+
+					global2ids[globalV].push_back(ConstantAsMetadata::get(
+								ConstantInt::get(Type::getInt64Ty(ctx), entry.id)));
 
-					assert(globalV);
 					aInst->replaceAllUsesWith(globalV);
 					erasedSet.insert(inst);
 				}
@@ -87,9 +413,15 @@ bool Alloca2Global::runOnModule(Module& M) {
 	for ( auto iter : erasedSet )
 		iter->eraseFromParent();
 
-	refFile.close();
+	for ( auto globalV : globals )
+		globalV->setMetadata("memory.id", MDNode::get(ctx, global2ids[globalV]));
 
-	return true;
-}
+	writeMemoryMap(entries);
 
+	if ( ShareAlloca )
+		errs() << "Alloca2Global : " << numOfAllocas << " allocas -> " << numOfGlobals
+			<< " globals, " << allocaBytes << " -> " << globalBytes << " bytes ( "
+			<< (allocaBytes - globalBytes) << " bytes saved )\n";
 
+	return true;
+}
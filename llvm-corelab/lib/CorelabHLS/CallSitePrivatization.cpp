@@ -23,8 +23,14 @@ char CallSitePrivatization::ID = 0;
 static RegisterPass<CallSitePrivatization> X("callsite-privatization", 
 		"CallSite Privatization", false, false);
 
+cl::opt<bool> ShareClone(
+		"share-clone", cl::init(false), cl::NotHidden,
+		cl::desc("Share one clone among call sites with the same argument binding"));
+
 void CallSitePrivatization::getAnalysisUsage( AnalysisUsage &AU ) const
 {
+	if ( ShareClone )
+		AU.addRequired< PADriverTest >();
 	AU.setPreservesAll();
 }
 
@@ -56,28 +62,78 @@ void CallSitePrivatization::getAnalysisUsage( AnalysisUsage &AU ) const
 	}
 
 
+// Constant arguments bind to themselves, pointer arguments to the memories
+// PA says they point to. Other scalars do not make clones differ.
+// Returns false if some pointer argument is unknown to PA
+// ( e.g. a value inside a clone made by this pass ).
+bool CallSitePrivatization::getCloneKey(CallInst *callInst, CloneKey &key) {
+	key.first = callInst->getCalledFunction();
+	key.second.clear();
+
+	for ( unsigned i = 0; i < callInst->getNumArgOperands(); i++ )
+	{
+		Value *arg = callInst->getArgOperand(i);
+		set<Value *> binding;
+
+		if ( isa<Constant>(arg) )
+			binding.insert(arg);
+		else if ( arg->getType()->isPointerTy() ) {
+			if ( !pa->pointer2Memory.count(arg) )
+				return false;
+
+			binding = pa->getPointedMemory(arg);
+			if ( binding.empty() )
+				return false;
+		}
+
+		key.second.push_back(binding);
+	}
+
+	return true;
+}
+
 void CallSitePrivatization::privatizeCallInst(CallInst *callInst) {
 	Function *originFunction = callInst->getCalledFunction();
 	assert(originFunction);
 
-	ValueToValueMapTy VMap;
-	Function *newFunction = CloneFunction(originFunction, VMap);
+	CloneKey key;
+	bool shareable = ShareClone && getCloneKey(callInst, key);
 
-	string func_name = newFunction->getName().str();
-	unsigned i = 0;
-	for ( auto ch : func_name )
-	{
-		if ( (ch) == '.' || (ch) == '-' )
-			func_name.replace(i,1,"_");
-		i++;
+	Function *newFunction = NULL;
+	if ( shareable && cloneCache.count(key) ) {
+		newFunction = cloneCache[key];
+		if (debug) errs() << "Share Clone : " << newFunction->getName() << "\n";
 	}
-	StringRef new_name(func_name);
+	else {
+		ValueToValueMapTy VMap;
+		newFunction = CloneFunction(originFunction, VMap);
+
+		string func_name = newFunction->getName().str();
+		unsigned i = 0;
+		for ( auto ch : func_name )
+		{
+			if ( (ch) == '.' || (ch) == '-' )
+				func_name.replace(i,1,"_");
+			i++;
+		}
+		StringRef new_name(func_name);
+
+		newFunction->setName(new_name);
 
-	newFunction->setName(new_name);
+		///////////
+		addFunction(newFunction);
+		///////////
 
-	///////////
-	funcSet.insert(newFunction);
-	///////////
+		//the callees of the clone wait for it as for the original
+		for ( auto bi = newFunction->begin(); bi != newFunction->end(); bi++ )
+			for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
+				if ( CallInst *cloneCallInst = dyn_cast<CallInst>(&*ii) )
+					if ( Function *callee = cloneCallInst->getCalledFunction() )
+						addCaller(callee, newFunction);
+
+		if ( shareable )
+			cloneCache[key] = newFunction;
+	}
 
 	unsigned numOperand = callInst->getNumArgOperands();
 	std::vector<Value *> actuals(0);
@@ -126,31 +182,43 @@ void CallSitePrivatization::setAllFunction() {
 					Function *callee = callInst->getCalledFunction();
 					assert(callee);
 
-					(func2caller[callee]).insert(func);
+					addCaller(callee, func);
 				}
 }
 
 void CallSitePrivatization::apply2AllFunction() {
-	seed = 1; //for getting next function in round robin way
+	//main first, then every function which has no caller to wait for
+	readyQueue.clear();
+	readyQueue.push_back(module->getFunction("main"));
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+		if ( funcSet.count(&*fi) && func2pending[&*fi] == 0 )
+			readyQueue.push_back(&*fi);
 
-	Function *nextFunction = module->getFunction("main");
-	func2done[nextFunction] = true;
 	while (1) {
+		Function *nextFunction = getNextFunction();
 		if ( nextFunction == NULL )
 			break;
 
-		if ( isReady(nextFunction) ) {
-			apply2Function(nextFunction);
-			func2done[nextFunction] = true;
-		}
+		if ( func2done[nextFunction] )
+			continue;
 
-		nextFunction = getNextFunction();
+		apply2Function(nextFunction);
+		setDone(nextFunction);
 	}
+
+	//callers never done : a recursion, its call sites are not privatized
+	for ( auto func : funcSet )
+		if ( !func2done[func] )
+			errs() << "CallSitePrivatization : " << func->getName()
+				<< " is not scheduled, " << func2pending[func] << " callers pending\n";
 }
 
 bool CallSitePrivatization::runOnModule(Module& M) {
 	module = &M;
 
+	if ( ShareClone )
+		pa = getAnalysis< PADriverTest >().getPA();
+
 	setAllFunction();
 	apply2AllFunction();
 
@@ -2,6 +2,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/ADT/DenseMap.h"
 
 #include "corelab/Analysis/PADriver.h"
@@ -25,6 +26,18 @@ cl::opt<bool> callPrint(
 		"callPrint", cl::init(false), cl::NotHidden,
 		cl::desc("Call Print"));
 
+cl::opt<bool> binaryDump(
+		"binaryDump", cl::init(false), cl::NotHidden,
+		cl::desc("Dump raw memory images into memory_state.bin ( decode with memoryStateDiff )"));
+
+cl::opt<bool> deltaDump(
+		"deltaDump", cl::init(false), cl::NotHidden,
+		cl::desc("With binaryDump, write only the ranges changed since the previous dump of a memory"));
+
+cl::opt<bool> storeTrace(
+		"storeTrace", cl::init(false), cl::NotHidden,
+		cl::desc("Trace every store ( object, offset, width, value ) instead of dumping memories at returns"));
+
 static int id;
 static int getID(void) { return ++id; }
 
@@ -76,21 +89,42 @@ void MemoryStatePrinter::setFunctions(void)
 			Type::getVoidTy(Context),
 			Type::getInt8PtrTy(Context)); // function name
 
-	registerStruct = module->getOrInsertFunction(
-			"registerStruct",
+	dumpMemory = module->getOrInsertFunction(
+			"dumpMemory",
 			Type::getVoidTy(Context),
-			Type::getInt32Ty(Context));
+			Type::getInt32Ty(Context),//id
+			Type::getInt8PtrTy(Context),//char * ( name )
+			Type::getInt8PtrTy(Context),//src
+			Type::getInt32Ty(Context),//datawidth
+			Type::getInt32Ty(Context),//numofelements
+			Type::getInt64Ty(Context),//size in bytes
+			Type::getInt32PtrTy(Context));//struct layout or null
 
-	startStruct = module->getOrInsertFunction(
-			"startStruct",
-			Type::getVoidTy(Context));
+	dumpMemoryDelta = module->getOrInsertFunction(
+			"dumpMemoryDelta",
+			Type::getVoidTy(Context),
+			Type::getInt32Ty(Context),//id
+			Type::getInt8PtrTy(Context),//char * ( name )
+			Type::getInt8PtrTy(Context),//src
+			Type::getInt32Ty(Context),//datawidth
+			Type::getInt32Ty(Context),//numofelements
+			Type::getInt64Ty(Context),//size in bytes
+			Type::getInt32PtrTy(Context));//struct layout or null
 
-	addElement = module->getOrInsertFunction(
-			"addElement",
+	dumpEnd = module->getOrInsertFunction(
+			"dumpEnd",
 			Type::getVoidTy(Context),
-			Type::getInt32Ty(Context),
-			Type::getInt32Ty(Context),
-			Type::getInt32Ty(Context));
+			Type::getInt8PtrTy(Context)); // function name
+
+	traceStore = module->getOrInsertFunction(
+			"traceStore",
+			Type::getVoidTy(Context),
+			Type::getInt32Ty(Context),//id
+			Type::getInt8PtrTy(Context),//char * ( name )
+			Type::getInt8PtrTy(Context),//base of the memory
+			Type::getInt8PtrTy(Context),//stored address
+			Type::getInt32Ty(Context),//width
+			Type::getInt64Ty(Context));//value
 }
 
 static Constant *geti8StrVal(Module& M, const char* str, Twine const& name){
@@ -177,26 +211,19 @@ static MemoryInfo getMemoryInfo(Type *eTy)
 	}
 }
 
-void MemoryStatePrinter::insertRuntime(int memID, Instruction *insertPoint) {
-	LLVMContext &Context = module->getContext();
-	std::vector<Value *> actuals(0);
-	actuals.clear();
-	actuals.resize(3);
-	actuals[0] = ConstantInt::get(Type::getInt32Ty(Context), memID);
-	actuals[1] = ConstantInt::get(Type::getInt32Ty(Context), currentDataWidth);
-	actuals[2] = ConstantInt::get(Type::getInt32Ty(Context), currentNum);
-
-	CallInst::Create(addElement, actuals, "", insertPoint);
+void MemoryStatePrinter::addLayoutElement(int memID) {
+	id2layout[memID].push_back(currentDataWidth);
+	id2layout[memID].push_back(currentNum);
 }
 
 
-void MemoryStatePrinter::insertStructHandler(Type *ty, int memID, Instruction *insertPoint) {
+void MemoryStatePrinter::insertStructHandler(Type *ty, int memID) {
 	if ( StructType *sTy = dyn_cast<StructType>(ty) ) {
 		for ( int i = 0; i < sTy->getNumElements(); i++ )
 		{
 			Type *eTy = sTy->getElementType(i);
 			
-			insertStructHandler(eTy, memID, insertPoint);
+			insertStructHandler(eTy, memID);
 		}
 	}
 	else if ( SequentialType *aTy = dyn_cast<SequentialType>(ty) ){
@@ -208,8 +235,7 @@ void MemoryStatePrinter::insertStructHandler(Type *ty, int memID, Instruction *i
 
 		MemoryInfo memInfo = getMemoryInfo( ty );
 		if ( !updateCurrentData( memInfo.dataWidth, memInfo.numOfElements ) ) {
-			//insert
-			insertRuntime(memID, insertPoint);
+			addLayoutElement(memID);
 
 			resetCurrentData();
 			updateCurrentData( memInfo.dataWidth, memInfo.numOfElements );
@@ -217,8 +243,7 @@ void MemoryStatePrinter::insertStructHandler(Type *ty, int memID, Instruction *i
 	}
 	else if (  IntegerType *iTy = dyn_cast<IntegerType>(ty) ){
 		if ( !updateCurrentData( iTy->getBitWidth(), 1 ) ) {
-			//insert
-			insertRuntime(memID, insertPoint);
+			addLayoutElement(memID);
 
 			resetCurrentData();
 			updateCurrentData( iTy->getBitWidth(), 1 );
@@ -226,8 +251,7 @@ void MemoryStatePrinter::insertStructHandler(Type *ty, int memID, Instruction *i
 	}
 	else if ( ty->isFloatTy() ){
 		if ( !updateCurrentData( 32 , 1 ) ) {
-			//insert
-			insertRuntime(memID, insertPoint);
+			addLayoutElement(memID);
 
 			resetCurrentData();
 			updateCurrentData( 32 , 1 );
@@ -235,8 +259,7 @@ void MemoryStatePrinter::insertStructHandler(Type *ty, int memID, Instruction *i
 	}
 	else if ( ty->isDoubleTy() ){
 		if ( !updateCurrentData( 64 , 1 ) ) {
-			//insert
-			insertRuntime(memID, insertPoint);
+			addLayoutElement(memID);
 
 			resetCurrentData();
 			updateCurrentData( 64 , 1 );
@@ -245,8 +268,7 @@ void MemoryStatePrinter::insertStructHandler(Type *ty, int memID, Instruction *i
 	}
 	else if ( isa<PointerType>(ty) ){ // define pointerWidth 2
 		if ( !updateCurrentData( 2 , 1 ) ) {
-			//insert
-			insertRuntime(memID, insertPoint);
+			addLayoutElement(memID);
 
 			resetCurrentData();
 			updateCurrentData( 2 , 1 );
@@ -255,11 +277,61 @@ void MemoryStatePrinter::insertStructHandler(Type *ty, int memID, Instruction *i
 
 }
 
-void MemoryStatePrinter::apply2Functions(void) {
+// (object, offset, width, value) of a store, the object is the PA memory
+// when the pointer has exactly one, else the address itself is recorded
+void MemoryStatePrinter::insertStoreTrace(StoreInst *storeInst) {
 	LLVMContext &Context = module->getContext();
+	const DataLayout &DL = module->getDataLayout();
+
+	Value *value = storeInst->getValueOperand();
+	Type *valueTy = value->getType();
+
+	//aggregates, vectors and wide values are not traced
+	if ( !valueTy->isIntegerTy() && !valueTy->isFloatingPointTy() && !valueTy->isPointerTy() )
+		return;
+
+	unsigned width = DL.getTypeStoreSizeInBits(valueTy);
+	if ( width > 64 )
+		return;
+	//an address differs run by run, marked as printBits does
+	if ( valueTy->isPointerTy() )
+		width = 2;
+
+	Value *traceValue = value;
+	if ( valueTy->isPointerTy() )
+		traceValue = new PtrToIntInst(value, Type::getInt64Ty(Context), "", storeInst);
+	else {
+		if ( valueTy->isFloatingPointTy() )
+			traceValue = new BitCastInst(value,
+					IntegerType::get(Context, valueTy->getPrimitiveSizeInBits()), "", storeInst);
+		if ( traceValue->getType()->getIntegerBitWidth() < 64 )
+			traceValue = new ZExtInst(traceValue, Type::getInt64Ty(Context), "", storeInst);
+	}
 
-	Function *mainF = module->getFunction("main");
-	Instruction *firstI = &*((&*(mainF->begin()))->begin());
+	Value *ptr = storeInst->getPointerOperand();
+	set<Value *> memories = pa->getPointedMemory(ptr);
+	Value *memory = memories.size() == 1 ? *memories.begin() : NULL;
+
+	std::vector<Value *> actuals(6);
+	if ( memory ) {
+		actuals[0] = ConstantInt::get(Type::getInt32Ty(Context), mem2objId[memory]);
+		actuals[1] = mem2name[memory];
+		actuals[2] = new BitCastInst(memory, Type::getInt8PtrTy(Context), "", storeInst);
+	}
+	else {
+		actuals[0] = ConstantInt::get(Type::getInt32Ty(Context), 0);
+		actuals[1] = unknownName;
+		actuals[2] = ConstantPointerNull::get(Type::getInt8PtrTy(Context));
+	}
+	actuals[3] = new BitCastInst(ptr, Type::getInt8PtrTy(Context), "", storeInst);
+	actuals[4] = ConstantInt::get(Type::getInt32Ty(Context), width);
+	actuals[5] = traceValue;
+
+	CallInst::Create(traceStore, actuals, "", storeInst);
+}
+
+void MemoryStatePrinter::apply2Functions(void) {
+	LLVMContext &Context = module->getContext();
 
 	for ( auto fi = module->begin(); fi != module->end(); fi++ ) 
 	{
@@ -311,51 +383,48 @@ void MemoryStatePrinter::apply2Functions(void) {
 
 			mem2name[memory] = 
 				geti8StrVal(*module, (memory->getName().str()).c_str(), memory->getName());
+			mem2objId[memory] = getID();
 
 			if ( haveStruct(memory->getType()) ) {
 				mem2id[memory] = getID();
 
-				std::vector<Value *> actuals(0);
-				actuals.clear();
-				actuals.resize(1);
-				actuals[0] = ConstantInt::get(Type::getInt32Ty(Context), mem2id[memory]);
-				CallInst::Create(registerStruct, actuals, "", firstI);
-
-				actuals.clear();
-				actuals.resize(0);
-				CallInst::Create(startStruct, actuals, "", firstI);
-
+				//( width, num ) pairs terminated by 0, a leading 0, 0 marks array of struct
 				PointerType *pointerTy = dyn_cast<PointerType>(memory->getType());
 				assert(pointerTy);
 				Type *elementTy = pointerTy->getElementType();
 
-				if ( SequentialType *sTy = dyn_cast<SequentialType>(elementTy) ) {
-					actuals.clear();
-					actuals.resize(3);
-					actuals[0] = ConstantInt::get(Type::getInt32Ty(Context), mem2id[memory]);
-					actuals[1] = ConstantInt::get(Type::getInt32Ty(Context), 0);
-					actuals[2] = ConstantInt::get(Type::getInt32Ty(Context), 0);
-					CallInst::Create(addElement, actuals, "", firstI);
+				if ( isa<SequentialType>(elementTy) ) {
+					id2layout[mem2id[memory]].push_back(0);
+					id2layout[mem2id[memory]].push_back(0);
 				}
 
 				resetCurrentData();
-				insertStructHandler(getFirstStruct(elementTy), mem2id[memory], firstI);
+				insertStructHandler(getFirstStruct(elementTy), mem2id[memory]);
 				if ( currentNum != 0 ) {
-					insertRuntime( mem2id[memory], firstI );
+					addLayoutElement( mem2id[memory] );
 					resetCurrentData();
 				}
 
 				//end sig
-				actuals.clear();
-				actuals.resize(3);
-				actuals[0] = ConstantInt::get(Type::getInt32Ty(Context), mem2id[memory]);
-				actuals[1] = ConstantInt::get(Type::getInt32Ty(Context), 0);
-				actuals[2] = ConstantInt::get(Type::getInt32Ty(Context), 0);
-				CallInst::Create(addElement, actuals, "", firstI);
+				id2layout[mem2id[memory]].push_back(0);
+				id2layout[mem2id[memory]].push_back(0);
 			}
 		}
 
 
+		//stores only, no dump at returns
+		if ( storeTrace ) {
+			list<StoreInst *> stores;
+			for ( auto bi = func->begin(); bi != func->end(); bi++ )
+				for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
+					if ( StoreInst *storeInst = dyn_cast<StoreInst>(&*ii) )
+						stores.push_back(storeInst);
+
+			for ( auto storeInst : stores )
+				insertStoreTrace(storeInst);
+			continue;
+		}
+
 		for ( auto point : insertionPoints )
 		{
 			std::vector<Value *> actuals(0);
@@ -363,9 +432,35 @@ void MemoryStatePrinter::apply2Functions(void) {
 			//Function End Print
 			actuals.resize(1);
 			actuals[0] = func_name;
-			CallInst::Create(printEnd, actuals, "", point);
+			CallInst::Create(binaryDump ? dumpEnd : printEnd, actuals, "", point);
+
+			if ( !callPrint && binaryDump ) {
+				//raw image of each memory, laid out as in the program
+				const DataLayout &DL = module->getDataLayout();
+				for ( auto memory : printMemories )
+				{
+					PointerType *pTy = dyn_cast<PointerType>(memory->getType());
+					assert(pTy);
+					MemoryInfo mInfo = getMemoryInfo(pTy->getElementType());
 
-			if ( !callPrint ) {
+					BitCastInst *ptrVal = 
+						new BitCastInst(memory, Type::getInt8PtrTy(Context), "", point); 
+
+					actuals.clear();
+					actuals.resize(7);
+					actuals[0] = ConstantInt::get(Type::getInt32Ty(Context), mem2objId[memory]);
+					actuals[1] = mem2name[memory];
+					actuals[2] = ptrVal;
+					actuals[3] = ConstantInt::get(Type::getInt32Ty(Context), mInfo.dataWidth);
+					actuals[4] = ConstantInt::get(Type::getInt32Ty(Context), mInfo.numOfElements);
+					actuals[5] = ConstantInt::get(Type::getInt64Ty(Context),
+							DL.getTypeAllocSize(pTy->getElementType()));
+					actuals[6] = getDumpLayout(memory);
+
+					CallInst::Create(deltaDump ? dumpMemoryDelta : dumpMemory, actuals, "", point);
+				}
+			}
+			else if ( !callPrint ) {
 
 			//memory print
 			for ( auto memory : printMemories )
@@ -416,6 +511,117 @@ void MemoryStatePrinter::apply2Functions(void) {
 
 }
 
+// byte offset and width of every scalar in ty, pointers as width 2
+static void collectFields(const DataLayout &DL, Type *ty, uint64_t base,
+		std::vector<uint32_t> &fields)
+{
+	if ( StructType *sTy = dyn_cast<StructType>(ty) ) {
+		const StructLayout *SL = DL.getStructLayout(sTy);
+		for ( unsigned i = 0; i < sTy->getNumElements(); i++ )
+			collectFields(DL, sTy->getElementType(i), base + SL->getElementOffset(i), fields);
+	}
+	else if ( SequentialType *aTy = dyn_cast<SequentialType>(ty) ) {
+		uint64_t elementSize = DL.getTypeAllocSize(aTy->getElementType());
+		for ( uint64_t i = 0; i < aTy->getNumElements(); i++ )
+			collectFields(DL, aTy->getElementType(), base + i * elementSize, fields);
+	}
+	else {
+		fields.push_back(base);
+		fields.push_back(ty->isPointerTy() ? 2 : DL.getTypeStoreSizeInBits(ty));
+	}
+}
+
+// layout handed to dumpMemory for a struct memory : stride ( the struct ),
+// pointer bytes, number of fields, ( offset, width ) per field.
+// memoryStateDiff masks the pointers and splits the image into fields with it.
+Constant *MemoryStatePrinter::getDumpLayout(Value *memory) {
+	LLVMContext &Context = module->getContext();
+	const DataLayout &DL = module->getDataLayout();
+	PointerType *layoutPtrTy = Type::getInt32PtrTy(Context);
+
+	if ( !mem2id.count(memory) )
+		return ConstantPointerNull::get(layoutPtrTy);
+	if ( mem2dumpLayout.count(memory) )
+		return mem2dumpLayout[memory];
+
+	Type *structTy = getFirstStruct(cast<PointerType>(memory->getType())->getElementType());
+	std::vector<uint32_t> fields;
+	collectFields(DL, structTy, 0, fields);
+
+	std::vector<uint32_t> layoutData;
+	layoutData.push_back(DL.getTypeAllocSize(structTy));
+	layoutData.push_back(DL.getPointerSize());
+	layoutData.push_back(fields.size() / 2);
+	layoutData.insert(layoutData.end(), fields.begin(), fields.end());
+
+	Constant *layoutInit = ConstantDataArray::get(Context, layoutData);
+	GlobalVariable *layout = new GlobalVariable(*module, layoutInit->getType(), true,
+			GlobalValue::InternalLinkage, layoutInit, "corelab_msp_dump_layout");
+
+	Constant *zero = Constant::getNullValue(Type::getInt32Ty(Context));
+	Constant *indices[] = {zero, zero};
+	mem2dumpLayout[memory] =
+		ConstantExpr::getGetElementPtr(layoutInit->getType(), layout, indices, true);
+	return mem2dumpLayout[memory];
+}
+
+// corelab_msp_struct_layouts[id] : layout of struct memory id, read by
+// printBits in place of the layouts registered at the start of main
+void MemoryStatePrinter::emitLayoutTable(void) {
+	LLVMContext &Context = module->getContext();
+	PointerType *layoutPtrTy = Type::getInt32PtrTy(Context);
+
+	std::vector<Constant *> table(id + 1, ConstantPointerNull::get(layoutPtrTy));
+	for ( auto &layoutIter : id2layout )
+	{
+		Constant *layoutInit = ConstantDataArray::get(Context, layoutIter.second);
+		GlobalVariable *layout = new GlobalVariable(*module, layoutInit->getType(), true,
+				GlobalValue::InternalLinkage, layoutInit, "corelab_msp_layout");
+
+		Constant *zero = Constant::getNullValue(Type::getInt32Ty(Context));
+		Constant *indices[] = {zero, zero};
+		table[layoutIter.first] =
+			ConstantExpr::getGetElementPtr(layoutInit->getType(), layout, indices, true);
+	}
+
+	ArrayType *tableTy = ArrayType::get(layoutPtrTy, table.size());
+	new GlobalVariable(*module, tableTy, true, GlobalValue::ExternalLinkage,
+			ConstantArray::get(tableTy, table), "corelab_msp_struct_layouts");
+}
+
+// corelab_msp_objects : ( id, name, base, size ) of every global memory,
+// terminated by a null base. traceStore finds the object of a store PA
+// can not resolve to one memory by its address, so the trace keeps
+// ( object, offset ) instead of an address that differs run by run.
+void MemoryStatePrinter::emitObjectTable(void) {
+	LLVMContext &Context = module->getContext();
+	const DataLayout &DL = module->getDataLayout();
+	Type *i8PtrTy = Type::getInt8PtrTy(Context);
+	StructType *objectTy = StructType::get(Type::getInt32Ty(Context), i8PtrTy, i8PtrTy,
+			Type::getInt64Ty(Context));
+
+	std::vector<Constant *> table;
+	for ( auto &objIter : mem2objId )
+	{
+		GlobalVariable *gv = dyn_cast<GlobalVariable>(objIter.first);
+		if ( !gv )
+			continue;
+
+		Constant *fields[] = {
+			ConstantInt::get(Type::getInt32Ty(Context), objIter.second),
+			mem2name[gv],
+			ConstantExpr::getBitCast(gv, i8PtrTy),
+			ConstantInt::get(Type::getInt64Ty(Context), DL.getTypeAllocSize(gv->getValueType()))
+		};
+		table.push_back(ConstantStruct::get(objectTy, fields));
+	}
+	table.push_back(Constant::getNullValue(objectTy));
+
+	ArrayType *tableTy = ArrayType::get(objectTy, table.size());
+	new GlobalVariable(*module, tableTy, true, GlobalValue::ExternalLinkage,
+			ConstantArray::get(tableTy, table), "corelab_msp_objects");
+}
+
 bool MemoryStatePrinter::runOnModule(Module& M) {
 
 	module = &M;
@@ -424,9 +630,14 @@ bool MemoryStatePrinter::runOnModule(Module& M) {
 	id = 0;
 
 	setFunctions();
+	unknownName = geti8StrVal(*module, "", "corelab_msp_unknown");
 
 	apply2Functions();
 
+	emitLayoutTable();
+	if ( storeTrace )
+		emitObjectTable();
+
 
 	return true;
 }
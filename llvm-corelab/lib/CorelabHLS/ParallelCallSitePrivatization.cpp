@@ -12,8 +12,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fstream>
-#include <iostream>
 
 using namespace llvm;
 using namespace corelab;
@@ -130,26 +128,16 @@ void ParallelCallSitePrivatization::apply2Function(Function *func) {
 	for ( auto callInst : callInstSet )
 	{
 		unsigned callId = getMetadata(callInst);
-		
-		bool isParallel = false;
-		for ( auto idIter : parallelSet )
-			if ( idIter == callId )
-				isParallel = true;
-		
-		if ( isParallel )
+
+		if ( parallelSet.count(callId) )
 			privatizeCallInst(callInst);
 	}
 
 	for ( auto callInst : callInstSet )
 	{
 		unsigned callId = getMetadata(callInst);
-		
-		bool isParallel = false;
-		for ( auto idIter : parallelSet )
-			if ( idIter == callId )
-				isParallel = true;
-		
-		if ( isParallel )
+
+		if ( parallelSet.count(callId) )
 			callInst->eraseFromParent();
 	}
 }
@@ -162,11 +150,6 @@ void ParallelCallSitePrivatization::buildCloneFunctionFromParallel(
 				Function *originFunction = callInst->getCalledFunction();
 				assert(func);
 
-				unsigned callId = getMetadata(callInst);
-				for ( auto idIter : parallelSet )
-					if ( idIter == callId )
-						continue;
-
 				if ( cloneMap.count(originFunction) )
 					continue;
 
@@ -193,8 +176,8 @@ void ParallelCallSitePrivatization::buildCloneFunctionFromParallel(
 void ParallelCallSitePrivatization::changeOriginToClone(
 																								DenseMap<Function *, Function *> &cloneMap,
 																								Function *parentFunc, Function *newFunc) {
-	funcSet.insert(newFunc);
-	func2caller[newFunc].insert(parentFunc);
+	addCaller(newFunc, parentFunc);
+	addFunction(newFunc);
 	
 	for ( auto bi = newFunc->begin(); bi != newFunc->end(); bi++ )
 		for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
@@ -203,9 +186,6 @@ void ParallelCallSitePrivatization::changeOriginToClone(
 				assert(calledFunction);
 
 				unsigned callId = getMetadata(callInst);
-				for ( auto idIter : parallelSet )
-					if ( idIter == callId ) 
-						continue; // parallel callsite will be handled in other function
 
 				if ( !cloneMap.count(calledFunction) )
 					assert(0);
@@ -246,7 +226,7 @@ void ParallelCallSitePrivatization::setAllFunction() {
 					Function *callee = callInst->getCalledFunction();
 					assert(callee);
 
-					(func2caller[callee]).insert(func);
+					addCaller(callee, func);
 				}
 
 	/*
@@ -258,20 +238,23 @@ void ParallelCallSitePrivatization::setAllFunction() {
 }
 
 void ParallelCallSitePrivatization::apply2AllFunction() {
-	seed = 1; //for getting next function in round robin way
+	//main first, then every function which has no caller to wait for
+	readyQueue.clear();
+	readyQueue.push_back(module->getFunction("main"));
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+		if ( funcSet.count(&*fi) && func2pending[&*fi] == 0 )
+			readyQueue.push_back(&*fi);
 
-	Function *nextFunction = module->getFunction("main");
-	func2done[nextFunction] = true;
 	while (1) {
+		Function *nextFunction = getNextFunction();
 		if ( nextFunction == NULL )
 			break;
 
-		if ( isReady(nextFunction) ) {
-			apply2Function(nextFunction);
-			func2done[nextFunction] = true;
-		}
+		if ( func2done[nextFunction] )
+			continue;
 
-		nextFunction = getNextFunction();
+		apply2Function(nextFunction);
+		setDone(nextFunction);
 	}
 }
 
@@ -284,7 +267,7 @@ bool ParallelCallSitePrivatization::runOnModule(Module& M) {
 			callInst->dump();
 	}
 	else {
-		errs() << "Can not find 'callsite_parallel.debug' file\n";
+		errs() << "Can not find 'corelab.parallel.callsite' metadata\n";
 		assert(0);
 	}
 
@@ -294,37 +277,28 @@ bool ParallelCallSitePrivatization::runOnModule(Module& M) {
 	return true;
 }
 
+// call site ids are handed over by CallSiteParallelAnalysis
+// as module metadata : !corelab.parallel.callsite = !{ !{i64 id}, ... }
 bool ParallelCallSitePrivatization::findParallelCallSite() {
-	string fileName = "callsite_parallel.debug";
-
-	ifstream openFile(fileName.data());
-	if ( openFile.is_open() ) {
-		string line;
-		while(getline(openFile, line)) {
-			int id = std::stoi(line);	
-			parallelSet.insert(id);
-		}
-	}
-	else
+	NamedMDNode *namedMDNode = module->getNamedMetadata("corelab.parallel.callsite");
+	if ( !namedMDNode )
 		return false;
 
+	for ( unsigned i = 0; i < namedMDNode->getNumOperands(); i++ )
+	{
+		MDNode *md = namedMDNode->getOperand(i);
+		ConstantInt *cInt = mdconst::extract<ConstantInt>(md->getOperand(0));
+		parallelSet.insert(cInt->getZExtValue());
+	}
+
 	for ( auto fi = module->begin(); fi != module->end(); fi++ )
 		for ( auto bi = (&*fi)->begin(); bi != (&*fi)->end(); bi++ )
 			for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
-				if ( CallInst *callInst = dyn_cast<CallInst>(&*ii) ) {
-					unsigned id = getMetadata(callInst);
-					
-					bool isParallel = false;
-					for ( auto idIter : parallelSet )
-						if ( idIter == id )
-							isParallel = true;
-
-					if ( isParallel )
+				if ( CallInst *callInst = dyn_cast<CallInst>(&*ii) )
+					if ( parallelSet.count(getMetadata(callInst)) )
 						parallelCallSiteSet.insert(callInst);
-				}
 
 	assert( parallelCallSiteSet.size() == parallelSet.size() );
 
 	return true;
 }
-
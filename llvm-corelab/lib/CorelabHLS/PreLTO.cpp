@@ -8,16 +8,39 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 
+#include <map>
+
 #define DEBUG_TYPE "IntrinsicLower"
 
 using namespace llvm;
 using namespace std;
 
+static cl::opt<bool> InlineMemIntrinsic(
+		"inline-mem-intrinsic", cl::init(false), cl::NotHidden,
+		cl::desc("Expand constant length memcpy / memmove / memset into loads and stores"));
+
+static cl::opt<unsigned> InlineMemLimit(
+		"inline-mem-limit", cl::init(32), cl::NotHidden,
+		cl::desc("Max elements of a straight line memory intrinsic expansion"));
+
+static cl::opt<unsigned> InlineMemUnroll(
+		"inline-mem-unroll", cl::init(4), cl::NotHidden,
+		cl::desc("Unroll factor of the loop for longer memcpy / memset expansion ( 0 : keep the call )"));
+
+static cl::opt<bool> IntrinsicDepthReport(
+		"intrinsic-depth-report", cl::init(false), cl::NotHidden,
+		cl::desc("Print the critical path depth of the hand lowered intrinsics"));
+
 namespace corelab {
 
 	static unsigned getByteSize(Type *elementTy) {
@@ -58,41 +81,39 @@ struct IntrinsicLower : public FunctionPass {
        TD = new DataLayout(&M);
 
        IL = new IntrinsicLowering(*TD);
+       replacements.clear();
+       depthReport.clear();
        return false;
     }
 
-    virtual bool runOnFunction(Function &F) {
-        bool modified = false;
+    virtual bool doFinalization(Module &M) {
+       if (IntrinsicDepthReport)
+           for (std::map<std::string, unsigned>::iterator it = depthReport.begin();
+                   it != depthReport.end(); ++it)
+               errs() << "IntrinsicLower depth : " << it->first << " : " << it->second << "\n";
+       return false;
+    }
 
-        // Examine all the instructions in this function to find the intrinsics
-        // that need to be lowered.
-        for (Function::iterator BB = F.begin(), EE = F.end(); BB != EE; ++BB) {
-            bool localChange = true;
-
-            // the below functions can modify instruction CI invalidating the
-            // iterator so we need to keep checking the BB until there are no
-            // more changes
-            while (localChange) {
-                localChange = false;
-                for (BasicBlock::iterator I = BB->begin(), E = BB->end(); I !=
-                        E; ++I) {
-                    if (CallInst *CI = dyn_cast<CallInst>(&*I)) {
-
-                        Function *calledFunction = CI->getCalledFunction();
-                        // ignore indirect function calls
-                        if (!calledFunction) continue;
-
-                        localChange = lowerIfIntrinsic(CI, calledFunction);
-
-                        // recheck the BB again
-                        if (localChange) {
-                            modified = true;
-                            break;
-                        }
-                    }
+    virtual bool runOnFunction(Function &F) {
+        // Collect the intrinsic calls first and rewrite them afterwards, so
+        // lowering never invalidates the scan. Each call is visited once, in
+        // program order.
+        vector<CallInst *> worklist;
+        for (Function::iterator BB = F.begin(), EE = F.end(); BB != EE; ++BB)
+            for (BasicBlock::iterator I = BB->begin(), E = BB->end(); I != E; ++I)
+                if (CallInst *CI = dyn_cast<CallInst>(&*I)) {
+                    Function *calledFunction = CI->getCalledFunction();
+                    // ignore indirect function calls
+                    if (calledFunction && calledFunction->isIntrinsic())
+                        worklist.push_back(CI);
                 }
-            }
-        }
+
+        // lowering a call only erases that call ( and its extractvalues ),
+        // the rest of the worklist stays valid
+        bool modified = false;
+        for (vector<CallInst *>::iterator it = worklist.begin(), e = worklist.end();
+                it != e; ++it)
+            modified |= lowerIfIntrinsic(*it, (*it)->getCalledFunction());
 
         return modified;
     }
@@ -101,14 +122,25 @@ private:
     Module *Mod;
     IntrinsicLowering *IL;
     const DataLayout* TD;
+    // replacement functions already declared in Mod
+    StringMap<Constant *> replacements;
+    CallInst *replaceCallWith(StringRef NewFn, CallInst *CI,
+            vector<Value*> &Args, Type *RetTy);
     bool lowerIfIntrinsic(CallInst *CI, Function *calledFunction);
     bool lowerIntrinsic(CallInst *CI, Function *calledFunction);
+    bool expandMemIntrinsic(MemIntrinsic *MI);
     bool lowerBswapIntrinsic(CallInst *CI, Function *calledFunction);
     bool lowerOverflowIntrinsic(CallInst *CI, Function *calledFunction);
+    bool lowerCountIntrinsic(CallInst *CI, Function *calledFunction);
+    bool lowerFunnelShiftIntrinsic(CallInst *CI, Function *calledFunction);
+    bool lowerSaturatingIntrinsic(CallInst *CI, Function *calledFunction);
     void createOverflowSumCarry(CallInst *CI, Instruction* &sum,
             Instruction* &carry);
-    void replaceOverflowIntrinsic(CallInst *CI, Instruction *sum, Instruction
-            *carry);
+    void replaceOverflowIntrinsic(CallInst *CI, Value *sum, Value *carry);
+
+    // intrinsic name -> deepest lowering seen
+    std::map<std::string, unsigned> depthReport;
+    void recordDepth(CallInst *CI, Instruction *before);
 
     std::string getIntrinsicMemoryAlignment(CallInst *CI);
 };
@@ -117,22 +149,18 @@ private:
 
 using namespace corelab;
 
-CallInst *ReplaceCallWith(const char *NewFn, CallInst *CI,
-								 vector<Value*> Args,
+CallInst *IntrinsicLower::replaceCallWith(StringRef NewFn, CallInst *CI,
+								 vector<Value*> &Args,
                                  Type *RetTy) {
-	// If we haven't already looked up this function, check to see if the
-	// program already contains a function with this name.
-	Module *M = CI->getParent()->getParent()->getParent();
-	// Get or insert the definition now.
-	std::vector<Type *> ParamTys;
-	std::vector<Value*> Params;
-	if (!Args.empty()) {
-		for (vector<Value*>::iterator it = Args.begin(); it != Args.end(); ++it) {
+	// Get or insert the declaration once per module
+	Constant *&FCache = replacements[NewFn];
+	if (!FCache) {
+		std::vector<Type *> ParamTys;
+		for (vector<Value*>::iterator it = Args.begin(); it != Args.end(); ++it)
 			ParamTys.push_back((*it)->getType());
-		}
-	}
 
-	Constant* FCache = M->getOrInsertFunction(NewFn, FunctionType::get(RetTy, ParamTys, false));
+		FCache = Mod->getOrInsertFunction(NewFn, FunctionType::get(RetTy, ParamTys, false));
+	}
 
 	Instruction * Ins = CI;
 	CallInst *NewCI = CallInst::Create(FCache, Args, "", Ins);
@@ -188,12 +216,31 @@ bool IntrinsicLower::lowerIfIntrinsic(CallInst *CI, Function *calledFunction) {
           return lowerIntrinsic(CI, calledFunction);
 
       case Intrinsic::uadd_with_overflow:
+      case Intrinsic::sadd_with_overflow:
+      case Intrinsic::usub_with_overflow:
+      case Intrinsic::ssub_with_overflow:
+      case Intrinsic::umul_with_overflow:
+      case Intrinsic::smul_with_overflow:
           return lowerOverflowIntrinsic(CI, calledFunction);
 
+      case Intrinsic::ctpop:
+      case Intrinsic::ctlz:
+      case Intrinsic::cttz:
+          return lowerCountIntrinsic(CI, calledFunction);
+
+      case Intrinsic::fshl:
+      case Intrinsic::fshr:
+          return lowerFunnelShiftIntrinsic(CI, calledFunction);
+
+      case Intrinsic::uadd_sat:
+      case Intrinsic::sadd_sat:
+      case Intrinsic::usub_sat:
+      case Intrinsic::ssub_sat:
+          return lowerSaturatingIntrinsic(CI, calledFunction);
+
       default:
 
           // All other intrinsic calls we must lower.
-          errs() << "Lowering: " << *CI << "\n";
           IL->LowerIntrinsicCall(CI);
 
           return true;
@@ -262,8 +309,6 @@ std::string IntrinsicLower::getIntrinsicMemoryAlignment(CallInst *CI) {
     // use modified struct size if first argument is a struct pointer
     if (isa<StructType>(destType)) {
         // Get the alignment, and decide which memcpy to use
-			errs() << "struct!!\n";
-
 			Value *destOp = CI->getOperand(0);
 			if ( GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(destOp) ) {
 				Value *offsetV = gep->getOperand(2); // 0 : ptr, 1: 0, 2: offset
@@ -343,8 +388,8 @@ void IntrinsicLower::createOverflowSumCarry(CallInst *CI, Instruction* &sum,
 
 }
 
-void IntrinsicLower::replaceOverflowIntrinsic(CallInst *CI, Instruction *sum,
-        Instruction *carry) {
+void IntrinsicLower::replaceOverflowIntrinsic(CallInst *CI, Value *sum,
+        Value *carry) {
 
 
     // find sum/carry extractvalue
@@ -354,7 +399,7 @@ void IntrinsicLower::replaceOverflowIntrinsic(CallInst *CI, Instruction *sum,
     for (Value::user_iterator i = CI->user_begin(), e = CI->user_end(); i !=
             e; ++i) {
         if (ExtractValueInst *EV = dyn_cast<ExtractValueInst>(*i)) {
-            Instruction *replace = NULL;
+            Value *replace = NULL;
             // sum
             if (*EV->idx_begin() == 0) {
                 replace = sum;
@@ -363,8 +408,6 @@ void IntrinsicLower::replaceOverflowIntrinsic(CallInst *CI, Instruction *sum,
                 assert(*EV->idx_begin() == 1);
                 replace = carry;
             }
-            errs() << "Replacing " << *EV << "\n";
-            errs() << "With " << *replace << "\n";
             EV->replaceAllUsesWith(replace);
             dead.push_back(EV);
 
@@ -383,32 +426,263 @@ void IntrinsicLower::replaceOverflowIntrinsic(CallInst *CI, Instruction *sum,
 }
 
 
-// Handle uadd.with.overflow.* intrinsics. For example:
+// Logic depth of the instructions a lowering inserted in front of CI
+// ( after before ), casts are wiring and do not count.
+static unsigned getCriticalPathDepth(Instruction *before, CallInst *CI) {
+	Instruction *first = before ? before->getNextNode() : &CI->getParent()->front();
+
+	DenseMap<Instruction *, unsigned> depth;
+	unsigned maxDepth = 0;
+	for ( Instruction *I = first; I != CI; I = I->getNextNode() )
+	{
+		unsigned d = 0;
+		for ( User::op_iterator op = I->op_begin(); op != I->op_end(); ++op )
+			if ( Instruction *opI = dyn_cast<Instruction>(op->get()) ) {
+				DenseMap<Instruction *, unsigned>::iterator it = depth.find(opI);
+				if ( it != depth.end() && d < it->second )
+					d = it->second;
+			}
+
+		if ( !isa<CastInst>(I) )
+			d++;
+		depth[I] = d;
+		if ( maxDepth < d )
+			maxDepth = d;
+	}
+	return maxDepth;
+}
+
+void IntrinsicLower::recordDepth(CallInst *CI, Instruction *before) {
+	if ( !IntrinsicDepthReport )
+		return;
+
+	unsigned &depth = depthReport[CI->getCalledFunction()->getName().str()];
+	unsigned d = getCriticalPathDepth(before, CI);
+	if ( depth < d )
+		depth = d;
+}
+
+// Balanced population count : adjacent fields of 1, 2, 4, .. bits are summed
+// in parallel, log2(width) levels of ( shift, and, add ).
+// Odd widths are counted in the next power of 2.
+static Value *createPopCount(Value *x, IRBuilder<> &builder) {
+	IntegerType *ty = cast<IntegerType>(x->getType());
+	unsigned width = PowerOf2Ceil(ty->getBitWidth());
+	IntegerType *wideTy = IntegerType::get(ty->getContext(), width);
+
+	Value *v = builder.CreateZExt(x, wideTy);
+	for ( unsigned k = 1; k < width; k <<= 1 )
+	{
+		Constant *mask = ConstantInt::get(wideTy, APInt::getSplat(width, APInt::getLowBitsSet(2 * k, k)));
+		Value *low = builder.CreateAnd(v, mask);
+		Value *high = builder.CreateAnd(builder.CreateLShr(v, k), mask);
+		v = builder.CreateAdd(low, high);
+	}
+	return builder.CreateTrunc(v, ty);
+}
+
+// ctpop : balanced tree above
+// ctlz  : smear the leading one to the right ( log2(width) or / shift levels ),
+//         count the zeros left
+// cttz  : ctpop(~x & (x - 1)), the trailing zeros as ones
+// both give width for 0, which is also right when is_zero_undef is set
+bool IntrinsicLower::lowerCountIntrinsic(CallInst *CI, Function *calledFunction) {
+	Value *x = CI->getArgOperand(0);
+	IntegerType *ty = dyn_cast<IntegerType>(x->getType());
+	if ( !ty ) {
+		IL->LowerIntrinsicCall(CI);
+		return true;
+	}
+
+	Instruction *before = CI->getPrevNode();
+	IRBuilder<> builder(CI);
+
+	Value *counted = x;
+	switch (calledFunction->getIntrinsicID()) {
+		case Intrinsic::ctlz:
+			for ( unsigned k = 1; k < ty->getBitWidth(); k <<= 1 )
+				counted = builder.CreateOr(counted, builder.CreateLShr(counted, k));
+			counted = builder.CreateNot(counted);
+			break;
+		case Intrinsic::cttz:
+			counted = builder.CreateAnd(builder.CreateNot(x),
+					builder.CreateSub(x, ConstantInt::get(ty, 1)));
+			break;
+		default:
+			break;
+	}
+
+	Value *result = createPopCount(counted, builder);
+
+	recordDepth(CI, before);
+	CI->replaceAllUsesWith(result);
+	CI->eraseFromParent();
+	return true;
+}
+
+// fshl(a, b, c) = (a << s) | ((b >> 1) >> (width - 1 - s))
+// fshr(a, b, c) = (b >> s) | ((a << 1) << (width - 1 - s)),  s = c % width
+// the extra shift by one keeps both shift amounts below width, so s == 0
+// needs no select
+bool IntrinsicLower::lowerFunnelShiftIntrinsic(CallInst *CI, Function *calledFunction) {
+	Value *a = CI->getArgOperand(0);
+	Value *b = CI->getArgOperand(1);
+	Value *c = CI->getArgOperand(2);
+	IntegerType *ty = dyn_cast<IntegerType>(a->getType());
+	if ( !ty ) {
+		IL->LowerIntrinsicCall(CI);
+		return true;
+	}
+
+	Instruction *before = CI->getPrevNode();
+	IRBuilder<> builder(CI);
+
+	unsigned width = ty->getBitWidth();
+	Value *s;
+	if ( isPowerOf2_32(width) )
+		s = builder.CreateAnd(c, ConstantInt::get(ty, width - 1));
+	else
+		s = builder.CreateURem(c, ConstantInt::get(ty, width));
+	Value *rest = builder.CreateSub(ConstantInt::get(ty, width - 1), s);
+
+	Value *result;
+	if ( calledFunction->getIntrinsicID() == Intrinsic::fshl )
+		result = builder.CreateOr(builder.CreateShl(a, s),
+				builder.CreateLShr(builder.CreateLShr(b, 1), rest));
+	else
+		result = builder.CreateOr(builder.CreateLShr(b, s),
+				builder.CreateShl(builder.CreateShl(a, 1), rest));
+
+	recordDepth(CI, before);
+	CI->replaceAllUsesWith(result);
+	CI->eraseFromParent();
+	return true;
+}
+
+// signed overflow of a + b ( a - b ) : the operands agree ( differ ) in sign
+// and the result does not
+static Value *createSignedOverflow(Value *a, Value *b, Value *result, bool isSub,
+		IRBuilder<> &builder) {
+	Value *operandSign = isSub ? builder.CreateXor(a, b) : builder.CreateNot(builder.CreateXor(a, b));
+	Value *resultSign = builder.CreateXor(a, result);
+	Value *zero = Constant::getNullValue(a->getType());
+	return builder.CreateICmpSLT(builder.CreateAnd(operandSign, resultSign), zero);
+}
+
+// Handle *.with.overflow.* intrinsics. For example:
 //      %uadd.i = call %0 @llvm.uadd.with.overflow.i64(i64 %105, i64 %106)
 //      %108 = extractvalue %0 %uadd.i, 0
 //      %109 = extractvalue %0 %uadd.i, 1
-// Replace this n-bit addition with a (n + 1) bit addition and shift out the
-// carry bit manually
+// uadd : replace this n-bit addition with a (n + 1) bit addition and shift out
+//        the carry bit manually
+// usub : borrow is a < b
+// sadd / ssub : sign test of the operands and the result
+// umul / smul : 2n bit product, overflow when it does not fit in n bits
 bool IntrinsicLower::lowerOverflowIntrinsic(CallInst *CI, Function *calledFunction) {
 
-    errs() << "Lowering overflow intrinsic: " << *CI << "\n";
-
+    Instruction *before = CI->getPrevNode();
+    Value *sum = 0, *carry = 0;
 
-    Instruction *sum = 0, *carry = 0;
+    Value *op0 = CI->getArgOperand(0);
+    Value *op1 = CI->getArgOperand(1);
+    IRBuilder<> builder(CI);
 
-    createOverflowSumCarry(CI, sum, carry);
+    switch (calledFunction->getIntrinsicID()) {
+      case Intrinsic::uadd_with_overflow: {
+        Instruction *sumI = 0, *carryI = 0;
+        createOverflowSumCarry(CI, sumI, carryI);
+        sum = sumI;
+        carry = carryI;
+        break;
+      }
+      case Intrinsic::usub_with_overflow:
+        sum = builder.CreateSub(op0, op1);
+        carry = builder.CreateICmpULT(op0, op1);
+        break;
+      case Intrinsic::sadd_with_overflow:
+        sum = builder.CreateAdd(op0, op1);
+        carry = createSignedOverflow(op0, op1, sum, false, builder);
+        break;
+      case Intrinsic::ssub_with_overflow:
+        sum = builder.CreateSub(op0, op1);
+        carry = createSignedOverflow(op0, op1, sum, true, builder);
+        break;
+      case Intrinsic::umul_with_overflow:
+      case Intrinsic::smul_with_overflow: {
+        bool isSigned = calledFunction->getIntrinsicID() == Intrinsic::smul_with_overflow;
+        unsigned size = op0->getType()->getPrimitiveSizeInBits();
+        IntegerType *wideTy = IntegerType::get(Mod->getContext(), size * 2);
+
+        Value *wide0 = isSigned ? builder.CreateSExt(op0, wideTy) : builder.CreateZExt(op0, wideTy);
+        Value *wide1 = isSigned ? builder.CreateSExt(op1, wideTy) : builder.CreateZExt(op1, wideTy);
+        Value *product = builder.CreateMul(wide0, wide1);
+        sum = builder.CreateTrunc(product, op0->getType());
+
+        Value *fitted = isSigned ? builder.CreateSExt(sum, wideTy) : builder.CreateZExt(sum, wideTy);
+        carry = builder.CreateICmpNE(fitted, product);
+        break;
+      }
+      default:
+        llvm_unreachable("Unknown overflow intrinsic");
+    }
 
+    recordDepth(CI, before);
     replaceOverflowIntrinsic(CI, sum, carry);
 
     return true;
 }
 
-bool IntrinsicLower::lowerBswapIntrinsic(CallInst *CI, Function *calledFunction) {
-	CI->dump();
-	calledFunction->dump();
+// saturating add / sub : the plain result, replaced by the bound on overflow
+bool IntrinsicLower::lowerSaturatingIntrinsic(CallInst *CI, Function *calledFunction) {
+	Value *a = CI->getArgOperand(0);
+	Value *b = CI->getArgOperand(1);
+	IntegerType *ty = dyn_cast<IntegerType>(a->getType());
+	if ( !ty ) {
+		IL->LowerIntrinsicCall(CI);
+		return true;
+	}
+
+	Instruction *before = CI->getPrevNode();
+	IRBuilder<> builder(CI);
+	unsigned width = ty->getBitWidth();
+	Value *zero = Constant::getNullValue(ty);
 
+	Value *result;
+	switch (calledFunction->getIntrinsicID()) {
+		case Intrinsic::uadd_sat: {
+			Value *sum = builder.CreateAdd(a, b);
+			result = builder.CreateSelect(builder.CreateICmpULT(sum, a),
+					ConstantInt::get(ty, APInt::getMaxValue(width)), sum);
+			break;
+		}
+		case Intrinsic::usub_sat:
+			result = builder.CreateSelect(builder.CreateICmpULT(a, b),
+					zero, builder.CreateSub(a, b));
+			break;
+		case Intrinsic::sadd_sat:
+		case Intrinsic::ssub_sat: {
+			bool isSub = calledFunction->getIntrinsicID() == Intrinsic::ssub_sat;
+			Value *plain = isSub ? builder.CreateSub(a, b) : builder.CreateAdd(a, b);
+			Value *overflow = createSignedOverflow(a, b, plain, isSub, builder);
+			// on overflow the result saturates toward the sign of a
+			Value *bound = builder.CreateSelect(builder.CreateICmpSLT(a, zero),
+					ConstantInt::get(ty, APInt::getSignedMinValue(width)),
+					ConstantInt::get(ty, APInt::getSignedMaxValue(width)));
+			result = builder.CreateSelect(overflow, bound, plain);
+			break;
+		}
+		default:
+			llvm_unreachable("Unknown saturating intrinsic");
+	}
+
+	recordDepth(CI, before);
+	CI->replaceAllUsesWith(result);
+	CI->eraseFromParent();
+	return true;
+}
+
+bool IntrinsicLower::lowerBswapIntrinsic(CallInst *CI, Function *calledFunction) {
 	Value *op_v = CI->getArgOperand(0);
-	op_v->dump();
 
 	std::string functionName;
 	functionName = "corelab_bswap";	
@@ -423,21 +697,162 @@ bool IntrinsicLower::lowerBswapIntrinsic(CallInst *CI, Function *calledFunction)
 	vector<Value *> Ops;
 	Ops.push_back(CI->getOperand(0));
 
-	errs() << "Replacing calls with: " << functionName << "\n";
-	ReplaceCallWith(functionName.c_str(), CI, Ops,
+	replaceCallWith(functionName, CI, Ops,
 			calledFunction->getReturnType());
 
 	return true;
 }
 
+// scalar element type a memory intrinsic pointer operand really points to
+// ( casts and zero offset geps stripped, arrays looked through ),
+// NULL for structs and other aggregates
+static Type *getScalarElementType(Value *ptr) {
+	PointerType *pTy = dyn_cast<PointerType>(ptr->stripPointerCasts()->getType());
+	if ( !pTy )
+		return NULL;
+
+	Type *elementTy = pTy->getElementType();
+	while ( ArrayType *aTy = dyn_cast<ArrayType>(elementTy) )
+		elementTy = aTy->getElementType();
+
+	if ( elementTy->isIntegerTy() || elementTy->isFloatingPointTy() || elementTy->isPointerTy() )
+		return elementTy;
+	return NULL;
+}
+
+// memset value repeated over an element, only when it can be formed
+static Value *getSplatValue(Value *byteV, Type *elementTy, IRBuilder<> &builder) {
+	if ( ConstantInt *cInt = dyn_cast<ConstantInt>(byteV) ) {
+		if ( cInt->isZero() )
+			return Constant::getNullValue(elementTy);
+
+		if ( IntegerType *iTy = dyn_cast<IntegerType>(elementTy) )
+			if ( iTy->getBitWidth() % 8 == 0 )
+				return ConstantInt::get(iTy, APInt::getSplat(iTy->getBitWidth(), cInt->getValue()));
+		return NULL;
+	}
+
+	IntegerType *iTy = dyn_cast<IntegerType>(elementTy);
+	if ( !iTy || iTy->getBitWidth() % 8 != 0 )
+		return NULL;
+	if ( iTy->getBitWidth() == 8 )
+		return byteV;
+
+	// byte * 0x0101..01
+	APInt ones = APInt::getSplat(iTy->getBitWidth(), APInt(8, 1));
+	return builder.CreateMul(builder.CreateZExt(byteV, iTy), ConstantInt::get(iTy, ones));
+}
+
+// Constant length transfers as element wide loads / stores of the element type,
+// so the hardware sees the accesses instead of a call to a serial copy FSM.
+//  - up to InlineMemLimit elements : straight line, every load before the stores
+//    ( register moves, also right for overlapping memmove )
+//  - longer memcpy / memset : a loop unrolled by InlineMemUnroll
+bool IntrinsicLower::expandMemIntrinsic(MemIntrinsic *MI) {
+	ConstantInt *lengthC = dyn_cast<ConstantInt>(MI->getLength());
+	if ( !lengthC || MI->isVolatile() )
+		return false;
+
+	Type *elementTy = getScalarElementType(MI->getRawDest());
+	if ( !elementTy )
+		return false;
+
+	MemTransferInst *MTI = dyn_cast<MemTransferInst>(MI);
+	if ( MTI && getScalarElementType(MTI->getRawSource()) != elementTy )
+		return false;
+
+	uint64_t elementSize = TD->getTypeAllocSize(elementTy);
+	uint64_t length = lengthC->getZExtValue();
+	if ( elementSize == 0 || length % elementSize != 0 )
+		return false;
+
+	uint64_t numOfElements = length / elementSize;
+	bool straightLine = numOfElements <= InlineMemLimit;
+	if ( !straightLine && (isa<MemMoveInst>(MI) || InlineMemUnroll == 0
+				|| numOfElements % InlineMemUnroll != 0) )
+		return false;
+
+	IRBuilder<> builder(MI);
+	LLVMContext &Context = MI->getContext();
+
+	Value *splat = NULL;
+	if ( MemSetInst *MSI = dyn_cast<MemSetInst>(MI) ) {
+		splat = getSplatValue(MSI->getValue(), elementTy, builder);
+		if ( !splat )
+			return false;
+	}
+
+	unsigned destAlign = MinAlign(MI->getDestAlignment(), elementSize);
+	Value *dest = builder.CreateBitCast(MI->getRawDest(),
+			elementTy->getPointerTo(MI->getDestAddressSpace()));
+
+	unsigned srcAlign = 0;
+	Value *src = NULL;
+	if ( MTI ) {
+		srcAlign = MinAlign(MTI->getSourceAlignment(), elementSize);
+		src = builder.CreateBitCast(MTI->getRawSource(),
+				elementTy->getPointerTo(MTI->getSourceAddressSpace()));
+	}
+
+	if ( straightLine ) {
+		vector<Value *> values;
+		for ( uint64_t i = 0; i < numOfElements; i++ )
+		{
+			if ( !MTI ) {
+				values.push_back(splat);
+				continue;
+			}
+			Value *srcPtr = builder.CreateConstInBoundsGEP1_64(src, i);
+			values.push_back(builder.CreateAlignedLoad(srcPtr, srcAlign));
+		}
+
+		for ( uint64_t i = 0; i < numOfElements; i++ )
+		{
+			Value *destPtr = builder.CreateConstInBoundsGEP1_64(dest, i);
+			builder.CreateAlignedStore(values[i], destPtr, destAlign);
+		}
+
+		MI->eraseFromParent();
+		return true;
+	}
+
+	// preheader -> body ( InlineMemUnroll elements per iteration ) -> rest
+	BasicBlock *preHeader = MI->getParent();
+	BasicBlock *exitBlock = preHeader->splitBasicBlock(MI->getIterator(), "mem.exit");
+	BasicBlock *body = BasicBlock::Create(Context, "mem.body", preHeader->getParent(), exitBlock);
+
+	preHeader->getTerminator()->setSuccessor(0, body);
+
+	IRBuilder<> bodyBuilder(body);
+	Type *indexTy = Type::getInt64Ty(Context);
+	PHINode *index = bodyBuilder.CreatePHI(indexTy, 2, "mem.index");
+	index->addIncoming(ConstantInt::get(indexTy, 0), preHeader);
+
+	for ( unsigned u = 0; u < InlineMemUnroll; u++ )
+	{
+		Value *offset = bodyBuilder.CreateAdd(index, ConstantInt::get(indexTy, u));
+		Value *value = splat;
+		if ( MTI )
+			value = bodyBuilder.CreateAlignedLoad(bodyBuilder.CreateInBoundsGEP(src, offset), srcAlign);
+		bodyBuilder.CreateAlignedStore(value, bodyBuilder.CreateInBoundsGEP(dest, offset), destAlign);
+	}
+
+	Value *next = bodyBuilder.CreateAdd(index, ConstantInt::get(indexTy, InlineMemUnroll), "mem.next");
+	index->addIncoming(next, body);
+	Value *done = bodyBuilder.CreateICmpEQ(next, ConstantInt::get(indexTy, numOfElements));
+	bodyBuilder.CreateCondBr(done, exitBlock, body);
+
+	MI->eraseFromParent();
+	return true;
+}
+
 // handle memcpy, memmove, memset by replacing with specific functions
 bool IntrinsicLower::lowerIntrinsic(CallInst *CI, Function *calledFunction) {
 
-	//memcpy for initialization -> return false;
+	if ( InlineMemIntrinsic && expandMemIntrinsic(cast<MemIntrinsic>(CI)) )
+		return true;
 
-	errs() << "Try to Lowering : \n";
-	CI->dump();
-	calledFunction->dump();
+	//memcpy for initialization -> return false;
 
 	//XXX: Why this part need
 	/*
@@ -516,8 +931,7 @@ bool IntrinsicLower::lowerIntrinsic(CallInst *CI, Function *calledFunction) {
 	if (CI->getOperand(2)->getType()->isIntegerTy(64))
 		fullFunctionName += "_i64";
 
-	errs() << "Replacing calls with: " << fullFunctionName << "\n";
-	ReplaceCallWith(fullFunctionName.c_str(), CI, Ops,
+	replaceCallWith(fullFunctionName, CI, Ops,
 			calledFunction->getReturnType());
 
 	return true;
@@ -14,11 +14,18 @@
 #include "llvm/ADT/BitVector.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 #include "corelab/CorelabHLS/Rec2Iter.h"
 #include "corelab/Utilities/InstInsertPt.h"
 #include "corelab/Utilities/LiveValues.h"
 
+#include <algorithm>
 #include <set>
 
 static bool debug = true;
@@ -47,15 +54,94 @@ namespace corelab
     "rec2iter-demote-alloca", cl::init(true), cl::NotHidden,
     cl::desc("When transforming a recursive function, convert alloca instructions into malloc/free"));
 
+  cl::opt<bool> StaticFrameStack(
+    "rec2iter-static-stack", cl::init(false), cl::NotHidden,
+    cl::desc("Allocate activation records in a statically sized array with a push/pop index"));
+
+  cl::opt<unsigned> MaxRecursionDepth(
+    "rec2iter-max-depth", cl::init(1024), cl::NotHidden,
+    cl::desc("Frames of the static stack when the depth is neither analyzed nor annotated (checked at run time)"));
+
+  cl::opt<bool> MergeRecursiveSCCs(
+    "rec2iter-scc", cl::init(false), cl::NotHidden,
+    cl::desc("Merge mutually recursive functions into one dispatcher before translating"));
+
+  STATISTIC(numSCCs,      "Number of mutually recursive SCCs merged");
   STATISTIC(numFcns,      "Number of recursive functions converted");
   STATISTIC(numCallsites, "Number of recursive callsites converted");
   STATISTIC(numRemat,     "Number of live values rematerialized");
+  STATISTIC(numRecompute, "Number of induction variables recomputed after callsites");
   STATISTIC(numDemote,    "Number of AllocaInsts demoted to malloc/free");
 
   bool Rec2Iter::runOnModule(Module &mod)
   {
     bool modified = false;
 
+    // Functions which recurse through each other are first
+    // merged into one self-recursive function.
+    std::set<Function *> mergedFcns;
+    if( MergeRecursiveSCCs )
+    {
+      // module order of functions, for a stable member order
+      DenseMap<Function *, unsigned> fcnOrder;
+      unsigned order = 0;
+      for(Module::iterator i=mod.begin(), e=mod.end(); i!=e; ++i)
+        fcnOrder[&*i] = order++;
+
+      std::vector< std::vector<Function *> > sccs;
+      {
+        CallGraph cg(mod);
+        for(scc_iterator<CallGraph*> i=scc_begin(&cg); !i.isAtEnd(); ++i)
+        {
+          const std::vector<CallGraphNode *> &nodes = *i;
+          if( nodes.size() < 2 )
+            continue;
+
+          std::vector<Function *> scc;
+          for(unsigned j=0; j<nodes.size(); ++j)
+          {
+            Function *member = nodes[j]->getFunction();
+            if( !member || member->isDeclaration() )
+            {
+              scc.clear();
+              break;
+            }
+            scc.push_back(member);
+          }
+
+          if( scc.empty() )
+            continue;
+
+          std::sort(scc.begin(), scc.end(),
+            [&fcnOrder](Function *a, Function *b) {
+              return fcnOrder[a] < fcnOrder[b];
+            });
+          sccs.push_back(scc);
+        }
+      }
+
+      for(unsigned i=0; i<sccs.size(); ++i)
+      {
+        std::vector<Function *> &scc = sccs[i];
+
+        if( TargetFunctionName != "" )
+        {
+          bool target = false;
+          for(unsigned j=0; j<scc.size(); ++j)
+            if( TargetFunctionName == scc[j]->getName() )
+              target = true;
+          if( !target )
+            continue;
+        }
+
+        if( Function *merged = mergeRecursiveSCC(mod, scc) )
+        {
+          mergedFcns.insert(merged);
+          modified = true;
+        }
+      }
+    }
+
     // For each function in this module
     typedef Module::iterator FI;
     for(FI i=mod.begin(), e=mod.end(); i!=e; ++i)
@@ -65,7 +151,8 @@ namespace corelab
       if( fcn.isDeclaration() )
         continue;
 
-      if(TargetFunctionName != "" && TargetFunctionName != fcn.getName())
+      if(TargetFunctionName != "" && TargetFunctionName != fcn.getName()
+      && !mergedFcns.count(&fcn))
         continue;
 
       modified |= runOnFunction(fcn);
@@ -85,12 +172,12 @@ namespace corelab
 
   struct LiveValueInfo
   {
-    int         ar_index;       // within the activation record
+    int         ar_index;       // within the activation record, -1 : not assigned
     BitVector   callsites;      // which callsites save this value?
     Value *     stackSlot;
 
     LiveValueInfo()
-      : ar_index(0), callsites(), stackSlot(0)
+      : ar_index(-1), callsites(), stackSlot(0)
     {}
   };
 
@@ -99,6 +186,18 @@ namespace corelab
 
   typedef Function::arg_iterator        ArgIt;
 
+  // An invertible update of an argument at one callsite:
+  //  actual = arg op operand, or operand - arg when negated.
+  struct IVUpdate
+  {
+    Instruction::BinaryOps  op;
+    Constant *              operand;
+    bool                    negated;
+  };
+
+  typedef std::vector<IVUpdate>         IVUpdates;  // one per callsite
+  typedef DenseMap<Argument*,IVUpdates> Arg2IV;
+
   // Collects all recursive callsites within this function.
   // Collects all exits of this function.
   // Returns true iff all callsites are simple tail recursive.
@@ -152,6 +251,154 @@ namespace corelab
     return tailRecursive;
   }
 
+  // Does a recursive callsite follow block start?
+  static bool reachesRecurrence(BasicBlock *start, Recurrences &recurrences)
+  {
+    DenseSet<BasicBlock*> recurBlocks;
+    for(RecIt i=recurrences.begin(), e=recurrences.end(); i!=e; ++i)
+      recurBlocks.insert( i->getInstruction()->getParent() );
+
+    DenseSet<BasicBlock*> visited;
+    std::vector<BasicBlock*> worklist(1, start);
+    while( !worklist.empty() )
+    {
+      BasicBlock *bb = worklist.back();
+      worklist.pop_back();
+
+      if( !visited.insert(bb).second )
+        continue;
+      if( recurBlocks.count(bb) )
+        return true;
+
+      for(succ_iterator j=succ_begin(bb), f=succ_end(bb); j!=f; ++j)
+        worklist.push_back(*j);
+    }
+    return false;
+  }
+
+  // Frames a recursion needs when one argument walks by a constant step
+  // until the test at the end of the entry block stops it:
+  //  - every recursive callsite passes (arg + step), steps of one sign,
+  //  - every other callsite passes a constant,
+  //  - only one side of the entry branch (arg pred K) reaches a recurrence.
+  // The smallest step gives the longest walk.
+  // Returns 0 when the depth can not be bounded this way.
+  static unsigned findRecursionDepth(Function &fcn, Recurrences &recurrences)
+  {
+    // A caller in an other module may pass any argument.
+    if( fcn.hasAddressTaken() || !fcn.hasLocalLinkage() )
+      return 0;
+
+    // A call to an other defined function may re-enter fcn and stack its
+    // frames above these ones.
+    for(inst_iterator i=inst_begin(fcn), e=inst_end(fcn); i!=e; ++i)
+    {
+      CallSite cs(&*i);
+      if( !cs )
+        continue;
+      Function *callee = cs.getCalledFunction();
+      if( !callee || (callee != &fcn && !callee->isDeclaration()) )
+        return 0;
+    }
+
+    BasicBlock *entry = &fcn.getEntryBlock();
+    BranchInst *br = dyn_cast<BranchInst>( entry->getTerminator() );
+    if( !br || !br->isConditional() )
+      return 0;
+    ICmpInst *cmp = dyn_cast<ICmpInst>( br->getCondition() );
+    if( !cmp )
+      return 0;
+
+    CmpInst::Predicate pred = cmp->getPredicate();
+    Argument *arg = dyn_cast<Argument>( cmp->getOperand(0) );
+    ConstantInt *bound = dyn_cast<ConstantInt>( cmp->getOperand(1) );
+    if( !arg || !bound )
+    {
+      pred = cmp->getSwappedPredicate();
+      arg = dyn_cast<Argument>( cmp->getOperand(1) );
+      bound = dyn_cast<ConstantInt>( cmp->getOperand(0) );
+    }
+    if( !arg || !bound )
+      return 0;
+
+    for(RecIt i=recurrences.begin(), e=recurrences.end(); i!=e; ++i)
+      if( i->getInstruction()->getParent() == entry )
+        return 0;
+
+    const bool trueRecurs = reachesRecurrence( br->getSuccessor(0), recurrences );
+    const bool falseRecurs = reachesRecurrence( br->getSuccessor(1), recurrences );
+    if( trueRecurs == falseRecurs )
+      return 0;
+    if( !trueRecurs )
+      pred = CmpInst::getInversePredicate(pred);
+
+    // values of arg which recur once more
+    ConstantRange recurring =
+      ConstantRange::makeExactICmpRegion(pred, bound->getValue());
+
+    const unsigned argno = arg->getArgNo();
+    APInt step;
+    for(RecIt i=recurrences.begin(), e=recurrences.end(); i!=e; ++i)
+    {
+      BinaryOperator *binop = dyn_cast<BinaryOperator>( i->getArgument(argno) );
+      if( !binop )
+        return 0;
+
+      ConstantInt *operand = 0;
+      if( binop->getOperand(0) == arg )
+        operand = dyn_cast<ConstantInt>( binop->getOperand(1) );
+      else if( binop->getOperand(1) == arg && binop->getOpcode() == Instruction::Add )
+        operand = dyn_cast<ConstantInt>( binop->getOperand(0) );
+      if( !operand )
+        return 0;
+
+      APInt s;
+      if( binop->getOpcode() == Instruction::Add )
+        s = operand->getValue();
+      else if( binop->getOpcode() == Instruction::Sub )
+        s = -operand->getValue();
+      else
+        return 0;
+
+      if( !s )
+        return 0;
+      if( !step )
+        step = s;
+      else if( step.isNegative() != s.isNegative() )
+        return 0;
+      else if( s.abs().ult( step.abs() ) )
+        step = s;
+    }
+
+    unsigned maxFrames = 0;
+    for(Value::user_iterator i=fcn.user_begin(), e=fcn.user_end(); i!=e; ++i)
+    {
+      CallSite cs( *i );
+      if( !cs.getInstruction() || cs.getCalledFunction() != &fcn )
+        return 0;
+      if( cs.getInstruction()->getParent()->getParent() == &fcn )
+        continue;
+
+      ConstantInt *init = dyn_cast<ConstantInt>( cs.getArgument(argno) );
+      if( !init )
+        return 0;
+
+      APInt v = init->getValue();
+      unsigned frames = 1;
+      while( recurring.contains(v) )
+      {
+        v += step;
+        if( ++frames > MaxRecursionDepth )
+          return 0;
+      }
+
+      if( maxFrames < frames )
+        maxFrames = frames;
+    }
+
+    return maxFrames;
+  }
+
   // Modify the function by splitting basic blocks
   // so that every recursive callsite is the first
   // instruction in its basic block.
@@ -170,14 +417,18 @@ namespace corelab
     }
   }
 
+  // An argument is an induction variable if every callsite
+  // passes an invertible integer update of it.
+  // Those are recorded in ivs, one update per callsite.
   static void findInductionVariables(Function &fcn,
-    Recurrences &recurrences)
+    Recurrences &recurrences, Arg2IV &ivs)
   {
     // Check each argument for induction variable...
     unsigned argno=0;
     for(ArgIt i=fcn.arg_begin(), e=fcn.arg_end(); i!=e; ++i, ++argno)
     {
       Argument *arg = &*i;
+      IVUpdates updates;
 
       // For each callsite
       for(RecIt j=recurrences.begin(), f=recurrences.end(); j!=f; ++j)
@@ -187,35 +438,37 @@ namespace corelab
 
         BinaryOperator *binop = dyn_cast< BinaryOperator >( actual );
         if( !binop )
-          continue;
+          break;
 
         // We can only handle invertible operations:
-        //  Add, FAdd, Sub, FSub, Xor.
+        //  Add, Sub, Xor.
         // We cannot do multiplication, division or remainder
         // because division is not closed.
-        // TODO: make negation (0-x) work.
+        // FAdd and FSub round, so (x + c) - c need not be x.
         Instruction::BinaryOps op = binop->getOpcode();
 
         if( op == Instruction::Add
-        ||  op == Instruction::FAdd
         ||  op == Instruction::Sub
-        ||  op == Instruction::FSub
         ||  op == Instruction::Xor )
         { /* good */ }
         else
-          continue;
+          break;
 
-        Constant *operand = 0;
+        IVUpdate update;
+        update.op = op;
+        update.operand = 0;
+        update.negated = false;
         if( binop->getOperand(0) == arg )
-          operand = dyn_cast< Constant >( binop->getOperand(1) );
-        else if( binop->getOperand(1) == arg
-        // Don't handle negation yet
-        &&       op != Instruction::Sub
-        &&       op != Instruction::FSub)
-          operand = dyn_cast< Constant >( binop->getOperand(0) );
-
-        if( !operand )
-          continue;
+          update.operand = dyn_cast< Constant >( binop->getOperand(1) );
+        else if( binop->getOperand(1) == arg )
+        {
+          update.operand = dyn_cast< Constant >( binop->getOperand(0) );
+          // operand - arg is its own inverse
+          update.negated = (op == Instruction::Sub);
+        }
+
+        if( !update.operand )
+          break;
 
         // At this callsite, we have an induction pattern (op,operand)
         
@@ -223,16 +476,40 @@ namespace corelab
           errs() << "\t- The argument " << *arg
                  << " is an induction variable with "
                  << " pattern (" << op
-                 << ", " << *operand
+                 << ", " << *update.operand
                  << ") at callsite " << *cs.getInstruction()
                  << ".\n";
 				}
 
-        // TODO:
-        //  record this information somehow
-        //  don't save IVs in the frame
-        //  recompute around callsites, somehow.
+        updates.push_back(update);
       }
+
+      // recomputation needs the pattern at every callsite
+      if( updates.size() == recurrences.size() )
+        ivs[arg] = updates;
+    }
+  }
+
+  // The caller's value of an induction variable,
+  // from the value its callee was called with.
+  static Value *invertUpdate(const IVUpdate &update, Value *calleeValue,
+    const Twine &name, Instruction *where)
+  {
+    if( update.negated )
+      return BinaryOperator::Create(Instruction::Sub,
+        update.operand, calleeValue, name, where);
+
+    switch( update.op )
+    {
+      case Instruction::Add:
+        return BinaryOperator::Create(Instruction::Sub,
+          calleeValue, update.operand, name, where);
+      case Instruction::Sub:
+        return BinaryOperator::Create(Instruction::Add,
+          calleeValue, update.operand, name, where);
+      default:
+        return BinaryOperator::Create(Instruction::Xor,
+          calleeValue, update.operand, name, where);
     }
   }
 
@@ -387,9 +664,13 @@ namespace corelab
     typedef std::vector<Type*> Types;
     Types membertys;
 
-    membertys.push_back( PointerType::getUnqual(framety) );
-		if ( debug )
-	    errs() << "\tFrame*\tprevious.frame;\n";
+    // A static frame stack finds the previous frame by its index.
+    if( !StaticFrameStack )
+    {
+      membertys.push_back( PointerType::getUnqual(framety) );
+		  if ( debug )
+	      errs() << "\tFrame*\tprevious.frame;\n";
+    }
 
     // return specifier
     Type *intty = Type::getInt32Ty(ctx);
@@ -402,7 +683,7 @@ namespace corelab
 			}
     }
 
-    if( !AllocateFramesOnHeap )
+    if( !AllocateFramesOnHeap && !StaticFrameStack )
     {
       Type *byteptr = PointerType::getUnqual(Type::getInt8Ty(ctx));
       membertys.push_back( byteptr );
@@ -414,6 +695,8 @@ namespace corelab
     // values into the same location.
     // This is a simple, greedy approximation to
     // the assignment problem.
+    // Every frame of a static stack is as large as
+    // the largest, so there any common type is shared.
     if( multipleRecurrences )
     {
       bool again;
@@ -421,6 +704,7 @@ namespace corelab
       do
       {
         again = false;
+        Type *batchty = StaticFrameStack ? 0 : intty;
 
         // ensure that no two values in this batch
         // interfere
@@ -445,10 +729,10 @@ namespace corelab
             const Value *lv = *j;
             LiveValueInfo &lvi = liveValues[lv];
 
-            if( lvi.ar_index > 0 )
+            if( lvi.ar_index >= 0 )
               continue; // already assigned.
 
-            if( lv->getType() != intty )
+            if( batchty && lv->getType() != batchty )
               continue; // common, compatible type.
 
             BitVector incompatible = interference;
@@ -461,7 +745,8 @@ namespace corelab
 
             if( !again )
             {
-              membertys.push_back( intty );
+              batchty = lv->getType();
+              membertys.push_back( batchty );
 							if ( debug )
 	              errs() << '\t' << *membertys.back() << '\t';
             }
@@ -514,7 +799,7 @@ namespace corelab
       {
         const Value *lv = *j;
         LiveValueInfo &lvi = liveValues[lv];
-        if( lvi.ar_index > 0)
+        if( lvi.ar_index >= 0)
           continue;
 
         // allocate a position in the frame
@@ -649,6 +934,287 @@ namespace corelab
   }
 
 
+  // Each static alloca of the old entry becomes an array of depth copies,
+  // the activation at stack index i uses copy i.
+  void Rec2Iter::demoteAllocasToStatic(Function &fcn, BasicBlock *oldEntry,
+    Value *frameIndex, unsigned depth)
+  {
+    Module *mod = fcn.getParent();
+    Type *intty = Type::getInt32Ty(mod->getContext());
+    Constant *zero = ConstantInt::get(intty, 0);
+
+    std::vector<AllocaInst *> allocas;
+    for(BasicBlock::iterator i=oldEntry->begin(), e=oldEntry->end(); i!=e; ++i)
+      if( AllocaInst *alloca = dyn_cast< AllocaInst >(&*i) )
+        allocas.push_back(alloca);
+
+    for(unsigned i=0, N=allocas.size(); i<N; ++i)
+    {
+      AllocaInst *alloca = allocas[i];
+
+      Type *elementty = alloca->getAllocatedType();
+      if( alloca->isArrayAllocation() )
+      {
+        ConstantInt *n = dyn_cast<ConstantInt>( alloca->getArraySize() );
+        if( !n )
+        {
+          errs() << "Rec2Iter: dynamic alloca " << alloca->getName()
+                 << " is not demoted\n";
+          continue;
+        }
+        elementty = ArrayType::get(elementty, n->getZExtValue());
+      }
+
+      ArrayType *copiesty = ArrayType::get(elementty, depth);
+      GlobalVariable *copies = new GlobalVariable(*mod, copiesty, false,
+        GlobalValue::InternalLinkage, ConstantAggregateZero::get(copiesty),
+        Twine("Frames_") + fcn.getName() + "_" + alloca->getName());
+
+      Value *index = new LoadInst(frameIndex, "FrameIndex", alloca);
+      Value *indices[2];
+      indices[0] = zero;
+      indices[1] = index;
+      Value *object = GetElementPtrInst::CreateInBounds(
+        copies, ArrayRef<Value *>(indices, indices + 2), "", alloca);
+      if( object->getType() != alloca->getType() )
+        object = new BitCastInst(object, alloca->getType(), "", alloca);
+
+      ++numDemote;
+      object->takeName( alloca );
+      alloca->replaceAllUsesWith(object);
+      alloca->eraseFromParent();
+    }
+  }
+
+  // Merge the functions of a recursive call graph SCC into one function
+  //    Rec2Iter_<f>_<g>..(i32 Tag, <f's args>, <g's args>, ..)
+  // whose entry dispatches on Tag to the body of each member.
+  // A call to a member becomes a call of the merged function with the
+  // member's tag and its arguments in the member's slots (undef elsewhere),
+  // so the whole SCC is self-recursive and runOnFunction converts it with
+  // one frame stack; the return specifier tells the callsites apart and
+  // the live values of each callsite decide what its frames hold.
+  // The members stay as wrappers for callers outside the SCC.
+  // Returns 0 when the SCC can not be merged.
+  // Attributes of a parameter slot of the merged function. Calls for
+  // an other member pass undef in the slot, so the attributes which
+  // constrain the value are dropped; ABI ones (zeroext, ..) stay.
+  static AttributeSet getSlotAttributes(LLVMContext &ctx, AttributeSet attrs)
+  {
+    AttrBuilder builder(attrs);
+    builder.removeAttribute(Attribute::NonNull);
+    builder.removeAttribute(Attribute::Dereferenceable);
+    builder.removeAttribute(Attribute::DereferenceableOrNull);
+    builder.removeAttribute(Attribute::Returned);
+    return AttributeSet::get(ctx, builder);
+  }
+
+  Function *Rec2Iter::mergeRecursiveSCC(Module &mod, std::vector<Function *> &scc)
+  {
+    LLVMContext &ctx = mod.getContext();
+    Type *intty = Type::getInt32Ty(ctx);
+    Type *retty = scc.front()->getReturnType();
+
+    std::set<Function *> members(scc.begin(), scc.end());
+    for(unsigned i=0; i<scc.size(); ++i)
+    {
+      Function *member = scc[i];
+
+      // indirect calls would bypass the merged function
+      if( member->getReturnType() != retty
+      ||  member->isVarArg()
+      ||  member->hasAddressTaken()
+      ||  member->hasPersonalityFn() )
+      {
+        if ( debug )
+          errs() << "Rec2Iter can not merge the SCC of "
+                 << member->getName() << ".\n";
+        return 0;
+      }
+
+      // these would copy from / return through the undef of the other slots
+      for(ArgIt j=member->arg_begin(), f=member->arg_end(); j!=f; ++j)
+        if( j->hasByValAttr() || j->hasInAllocaAttr() || j->hasStructRetAttr()
+        ||  j->hasNestAttr() || j->hasSwiftErrorAttr() )
+        {
+          if ( debug )
+            errs() << "Rec2Iter can not merge the SCC of "
+                   << member->getName() << ", argument " << j->getName()
+                   << " is passed in memory.\n";
+          return 0;
+        }
+    }
+
+    // Tag, then the arguments of each member
+    std::vector<Type *> paramtys(1, intty);
+    std::vector<unsigned> firstArg;
+    std::string name = "Rec2Iter";
+    for(unsigned i=0; i<scc.size(); ++i)
+    {
+      Function *member = scc[i];
+      firstArg.push_back( paramtys.size() );
+      for(ArgIt j=member->arg_begin(), f=member->arg_end(); j!=f; ++j)
+        paramtys.push_back( j->getType() );
+      name += "_" + member->getName().str();
+    }
+
+    FunctionType *fty = FunctionType::get(retty, paramtys, false);
+    Function *merged = Function::Create(
+      fty, GlobalValue::InternalLinkage, name, &mod);
+
+    // parameter attributes of each member in its slots, return
+    // attributes only when all members agree on them
+    AttributeSet retattrs = scc.front()->getAttributes().getRetAttributes();
+    std::vector<AttributeSet> paramattrs(paramtys.size());
+    for(unsigned i=0; i<scc.size(); ++i)
+    {
+      AttributeList memberattrs = scc[i]->getAttributes();
+      if( memberattrs.getRetAttributes() != retattrs )
+        retattrs = AttributeSet();
+      for(unsigned j=0; j<scc[i]->arg_size(); ++j)
+        paramattrs[ firstArg[i] + j ] =
+          getSlotAttributes(ctx, memberattrs.getParamAttributes(j));
+    }
+    merged->setAttributes( AttributeList::get(ctx, AttributeSet(),
+      retattrs, paramattrs) );
+
+    // the merged stack holds the frames of every member, so it keeps the
+    // largest annotated depth
+    unsigned maxDepth = 0;
+    bool annotated = false;
+    for(unsigned i=0; i<scc.size(); ++i)
+    {
+      unsigned depth;
+      if( !scc[i]->hasFnAttribute("rec2iter-max-depth") )
+        continue;
+      if( scc[i]->getFnAttribute("rec2iter-max-depth").getValueAsString()
+          .getAsInteger(10, depth) )
+        continue;
+      maxDepth = std::max(maxDepth, depth);
+      annotated = true;
+    }
+    if( annotated )
+      merged->addFnAttr("rec2iter-max-depth", std::to_string(maxDepth));
+
+    std::vector<Argument *> args;
+    for(ArgIt j=merged->arg_begin(), f=merged->arg_end(); j!=f; ++j)
+      args.push_back(&*j);
+    args[0]->setName("Tag");
+
+    BasicBlock *dispatch = BasicBlock::Create(ctx, "Dispatch", merged);
+    std::vector<AllocaInst *> allocas;
+    std::vector<BasicBlock *> entries;
+
+    // Move the body of each member into the merged function.
+    for(unsigned i=0; i<scc.size(); ++i)
+    {
+      Function *member = scc[i];
+      entries.push_back( &member->getEntryBlock() );
+
+      // static allocas are hoisted into the dispatcher, so they
+      // are still allocated once per activation
+      for(BasicBlock::iterator j=entries.back()->begin(), f=entries.back()->end(); j!=f; ++j)
+        if( AllocaInst *alloca = dyn_cast<AllocaInst>(&*j) )
+          if( isa<ConstantInt>( alloca->getArraySize() ) )
+            allocas.push_back(alloca);
+
+      merged->getBasicBlockList().splice(
+        merged->end(), member->getBasicBlockList());
+
+      unsigned argno = firstArg[i];
+      for(ArgIt j=member->arg_begin(), f=member->arg_end(); j!=f; ++j, ++argno)
+      {
+        args[argno]->takeName(&*j);
+        j->replaceAllUsesWith(args[argno]);
+      }
+    }
+
+    SwitchInst *sw = SwitchInst::Create(
+      args[0], entries.front(), scc.size(), dispatch);
+    for(unsigned i=0; i<scc.size(); ++i)
+      sw->addCase(ConstantInt::get(cast<IntegerType>(intty), i), entries[i]);
+    for(unsigned i=0; i<allocas.size(); ++i)
+      allocas[i]->moveBefore(sw);
+
+    // Calls to members inside the merged body become self-recursive.
+    // Debug info of the moved bodies refers to the members, drop it.
+    std::vector<Instruction *> calls, dbgs;
+    for(inst_iterator i=inst_begin(merged), e=inst_end(merged); i!=e; ++i)
+    {
+      Instruction *inst = &*i;
+      inst->setDebugLoc(DebugLoc());
+
+      if( isa<DbgInfoIntrinsic>(inst) )
+        dbgs.push_back(inst);
+      else if( CallInst *call = dyn_cast<CallInst>(inst) )
+        if( members.count( call->getCalledFunction() ) )
+          calls.push_back(call);
+    }
+    for(unsigned i=0; i<dbgs.size(); ++i)
+      dbgs[i]->eraseFromParent();
+
+    // tag of each member, and the arguments for calling it
+    DenseMap<Function *, unsigned> tags;
+    for(unsigned i=0; i<scc.size(); ++i)
+      tags[ scc[i] ] = i;
+
+    for(unsigned i=0; i<calls.size(); ++i)
+    {
+      CallInst *call = cast<CallInst>( calls[i] );
+      unsigned tag = tags[ call->getCalledFunction() ];
+
+      std::vector<Value *> actuals;
+      actuals.push_back( ConstantInt::get(intty, tag) );
+      for(unsigned j=1; j<paramtys.size(); ++j)
+        actuals.push_back( UndefValue::get(paramtys[j]) );
+      for(unsigned j=0; j<call->getNumArgOperands(); ++j)
+        actuals[ firstArg[tag] + j ] = call->getArgOperand(j);
+
+      // the call keeps its own attributes, moved to the member's slots
+      AttributeList callattrs = call->getAttributes();
+      std::vector<AttributeSet> actualattrs(paramtys.size());
+      for(unsigned j=0; j<call->getNumArgOperands(); ++j)
+        actualattrs[ firstArg[tag] + j ] =
+          getSlotAttributes(ctx, callattrs.getParamAttributes(j));
+
+      CallInst *recur = CallInst::Create(merged, actuals, "", call);
+      recur->setAttributes( AttributeList::get(ctx, callattrs.getFnAttributes(),
+        callattrs.getRetAttributes(), actualattrs) );
+      recur->takeName(call);
+      call->replaceAllUsesWith(recur);
+      call->eraseFromParent();
+    }
+
+    // Each member calls the merged function with its tag.
+    for(unsigned i=0; i<scc.size(); ++i)
+    {
+      Function *member = scc[i];
+      BasicBlock *wrapper = BasicBlock::Create(ctx, "Wrapper", member);
+
+      std::vector<Value *> actuals;
+      actuals.push_back( ConstantInt::get(intty, i) );
+      for(unsigned j=1; j<paramtys.size(); ++j)
+        actuals.push_back( UndefValue::get(paramtys[j]) );
+      unsigned argno = firstArg[i];
+      for(ArgIt j=member->arg_begin(), f=member->arg_end(); j!=f; ++j, ++argno)
+        actuals[argno] = &*j;
+
+      CallInst *call = CallInst::Create(merged, actuals, "", wrapper);
+      call->setAttributes( merged->getAttributes() );
+      if( retty->isVoidTy() )
+        ReturnInst::Create(ctx, wrapper);
+      else
+        ReturnInst::Create(ctx, call, wrapper);
+    }
+
+    ++numSCCs;
+    if ( debug )
+      errs() << "Rec2Iter merged " << scc.size() << " functions into "
+             << merged->getName() << ".\n";
+
+    return merged;
+  }
+
   bool Rec2Iter::runOnFunction(Function &fcn)
   {
     LLVMContext &ctx = fcn.getParent()->getContext();
@@ -676,7 +1242,29 @@ namespace corelab
 		}
 
 
-    if( DemoteAllocasToHeap )
+    // Frames of the static stack: analyzed, annotated, or the default
+    // with a run time overflow check.
+    unsigned stackDepth = 0;
+    bool checkOverflow = false;
+    if( StaticFrameStack )
+    {
+      stackDepth = findRecursionDepth(fcn, recurrences);
+      if( !stackDepth && fcn.hasFnAttribute("rec2iter-max-depth") )
+        if( fcn.getFnAttribute("rec2iter-max-depth").getValueAsString()
+            .getAsInteger(10, stackDepth) )
+          stackDepth = 0;
+      if( !stackDepth )
+      {
+        stackDepth = MaxRecursionDepth;
+        checkOverflow = true;
+      }
+
+      if ( debug )
+        errs() << "\t- static stack of " << stackDepth << " frames"
+               << (checkOverflow ? " (checked)\n" : "\n");
+    }
+
+    if( DemoteAllocasToHeap && !StaticFrameStack )
       demoteAllocasToHeap(fcn);
 
     splitBlocksAtRecurrences(recurrences);
@@ -698,8 +1286,27 @@ namespace corelab
     Instruction *t_entry = BranchInst::Create(bb_descend, bb_entry);
     Instruction *t_descend = BranchInst::Create(oldEntry, bb_descend);
 
+    // The static stack index, -1 : no frame.
+    // It is shared by every invocation, like the frames, so a call
+    // re-entering fcn pushes above the frames of the one it came from;
+    // each invocation stops ascending at its own first frame.
+    GlobalVariable *frame_index_storage = 0;
+    Value *first_index = 0;
+    if( StaticFrameStack )
+    {
+      frame_index_storage = new GlobalVariable(*fcn.getParent(), intty, false,
+        GlobalValue::InternalLinkage, ConstantInt::get(intty, ~0UL, true),
+        Twine("FrameIndex_") + fcn.getName());
+      Value *base = new LoadInst(frame_index_storage, "FrameBase", t_entry);
+      first_index = BinaryOperator::CreateNSWAdd(
+        base, one, "FirstIndex", t_entry);
+
+      demoteAllocasToStatic(fcn, oldEntry, frame_index_storage, stackDepth);
+    }
+
     // determine which arguments are induction variables
-    findInductionVariables(fcn, recurrences);
+    Arg2IV ivs;
+    findInductionVariables(fcn, recurrences, ivs);
 
     // We want to put all function arguments into local variables.
     // This way, they will be saved/restored like every other
@@ -735,6 +1342,38 @@ namespace corelab
     findRematOpportunities(fcn, recurrences, liveValuesPerCallsite,
       rematPerCallsite, stackSavePerCallsite);
 
+    // Induction variables live across a callsite are not saved;
+    // the caller recomputes them from the callee's argument.
+    // That is done after EVERY callsite, so at the end of an
+    // activation its slot always holds its own argument.
+    typedef std::vector< std::pair<PHINode*,IVUpdates*> > Recomputes;
+    Recomputes recomputes;
+    for(ArgIt i=fcn.arg_begin(), e=fcn.arg_end(); i!=e; ++i)
+    {
+      Argument *arg = &*i;
+      if( !ivs.count(arg) )
+        continue;
+
+      PHINode *phi = arg2phi[arg];
+      bool live = false;
+      for(RecIt j=recurrences.begin(), f=recurrences.end(); j!=f; ++j)
+      {
+        ValueList &all = liveValuesPerCallsite[ j->getInstruction() ];
+        if( std::find(all.begin(), all.end(), phi) != all.end() )
+          live = true;
+
+        ValueList &stackSave = stackSavePerCallsite[ j->getInstruction() ];
+        stackSave.erase(
+          std::remove(stackSave.begin(), stackSave.end(), phi), stackSave.end());
+      }
+
+      if( live )
+      {
+        ++numRecompute;
+        recomputes.push_back( std::make_pair(phi, &ivs[arg]) );
+      }
+    }
+
     // build the frame type, and the LiveValues table to organize it.
     LiveValueInfoTable liveValues;
 
@@ -767,6 +1406,19 @@ namespace corelab
 		const DataLayout &td = fcn.getParent()->getDataLayout();
     const unsigned frameSizeBytes = td.getTypeSizeInBits(framety)/8;
 
+    // Fixed fields of the activation record
+    Constant *retspecField = StaticFrameStack ? zero : one;
+    Constant *oldspField = multipleRecurrences ? two : one;
+
+    GlobalVariable *frames = 0;
+    if( StaticFrameStack )
+    {
+      ArrayType *framesty = ArrayType::get(framety, stackDepth);
+      frames = new GlobalVariable(*mod, framesty, false,
+        GlobalValue::InternalLinkage, ConstantAggregateZero::get(framesty),
+        Twine("Frames_") + fcn.getName());
+    }
+
     if ( debug ) { 
       errs() << "\t- Activation record is "
              << frameSizeBytes << " bytes\n";
@@ -825,7 +1477,33 @@ namespace corelab
       // create a new activation record.
       Value *activation1 = 0;
 
-      if( AllocateFramesOnHeap )
+      if( StaticFrameStack )
+      {
+        // Push: the next element of the frame array.
+        Value *oldIndex = new LoadInst(
+          frame_index_storage, "OldIndex", t_descend);
+        Value *newIndex = BinaryOperator::CreateNSWAdd(
+          oldIndex, one, "NewIndex", t_descend);
+        new StoreInst(newIndex, frame_index_storage, t_descend);
+
+        Value *indices[2];
+        indices[0] = zero;
+        indices[1] = newIndex;
+        activation1 = GetElementPtrInst::CreateInBounds(
+          frames, ArrayRef<Value *>(indices, indices + 2),
+          "NewFrame", t_descend);
+
+        if( checkOverflow )
+        {
+          Value *overflow = new ICmpInst(t_descend, ICmpInst::ICMP_UGE,
+            newIndex, ConstantInt::get(intty, stackDepth), "StackOverflow");
+          Instruction *thenTerm =
+            SplitBlockAndInsertIfThen(overflow, t_descend, true);
+          CallInst::Create(
+            Intrinsic::getDeclaration(mod, Intrinsic::trap), "", thenTerm);
+        }
+      }
+      else if( AllocateFramesOnHeap )
       {
         // Create it on the heap.
         Value *malloc = getMalloc(*mod);
@@ -851,9 +1529,7 @@ namespace corelab
         // store old sp into the frame
         Value *indices[2];
         indices[0] = zero;
-        indices[1] = two;
-        if( !multipleRecurrences )
-          indices[1] = one;
+        indices[1] = oldspField;
 
         ArrayRef<Value *> indicesRef(indices, indices + 2);
 
@@ -862,6 +1538,7 @@ namespace corelab
         new StoreInst(restoreptr, gep, t_descend);
       }
       // The 'next activation record' field
+      if( !StaticFrameStack )
       {
         // Load the old activation record.
         Value *old_frame = new LoadInst(
@@ -884,7 +1561,7 @@ namespace corelab
 
         Value *indices[2];
         indices[0] = zero;
-        indices[1] = one;
+        indices[1] = retspecField;
 
         ArrayRef<Value *> indicesRef(indices, indices + 2);
 
@@ -925,13 +1602,33 @@ namespace corelab
 
       ArrayRef<Value *> indicesRef(indices, indices + 2);
 
-      Value *gep = GetElementPtrInst::CreateInBounds(
-        newFrame, indicesRef,
-        "TopFrame.Next", bb_ascend);
-      LoadInst *next_frame = new LoadInst(
-        gep, "PopFrame", bb_ascend);
+      Value *gep = 0;
+      Value *next_frame = 0;
+      Value *lastIndex = 0;
+      if( StaticFrameStack )
+      {
+        // Pop: the previous element of the frame array
+        // (not a frame when this was the last one).
+        lastIndex = new LoadInst(
+          frame_index_storage, "TopIndex", bb_ascend);
+        Value *popIndex = BinaryOperator::CreateNSWSub(
+          lastIndex, one, "PopIndex", bb_ascend);
+        new StoreInst(popIndex, frame_index_storage, bb_ascend);
+
+        indices[1] = popIndex;
+        next_frame = GetElementPtrInst::Create(
+          frames->getValueType(), frames, indicesRef, "PopFrame", bb_ascend);
+      }
+      else
+      {
+        gep = GetElementPtrInst::CreateInBounds(
+          newFrame, indicesRef,
+          "TopFrame.Next", bb_ascend);
+        next_frame = new LoadInst(
+          gep, "PopFrame", bb_ascend);
+      }
       new StoreInst(next_frame, activation_record_storage, bb_ascend);
-      indices[1] = one;
+      indices[1] = retspecField;
 
       Value *ret_spec = 0;
       // load the return specifier BEFORE stack restore!!!
@@ -944,7 +1641,11 @@ namespace corelab
           gep, "ReturnSpecifier", bb_ascend);
       }
 
-      if( AllocateFramesOnHeap )
+      if( StaticFrameStack )
+      {
+        // nothing to release
+      }
+      else if( AllocateFramesOnHeap )
       {
         // free() the frame
         Value *free = getFree(*mod);
@@ -957,9 +1658,7 @@ namespace corelab
       {
         // llvm.stackrestore() the frame.
         indices[0] = zero;
-        indices[1] = two;
-        if( !multipleRecurrences )
-          indices[1] = one;
+        indices[1] = oldspField;
 
         Value *gep = GetElementPtrInst::CreateInBounds(
           newFrame, indicesRef,
@@ -979,6 +1678,16 @@ namespace corelab
         switch_return = SwitchInst::Create(ret_spec, bb_exit,
           recurrences.size(), bb_ascend);
       }
+      else if( StaticFrameStack )
+      {
+        Value *lastFrame = CmpInst::Create(
+          Instruction::ICmp,
+          CmpInst::ICMP_EQ, lastIndex, first_index,
+          "LastFrameTest", bb_ascend);
+
+        switch_return = SwitchInst::Create(lastFrame, bb_exit,
+          recurrences.size(), bb_ascend);
+      }
       else
       {
         Value *lastFrame = CmpInst::Create(
@@ -1120,8 +1829,48 @@ namespace corelab
         new StoreInst(load, lvi.stackSlot, where );
       }
 
+      // Caller will recompute induction variables
+      // by inverting the update of this callsite.
+      for(unsigned k=0; k<recomputes.size(); ++k)
+      {
+        PHINode *phi = recomputes[k].first;
+        const IVUpdate &update = (*recomputes[k].second)[ri];
+        Value *slot = liveValues[phi].stackSlot;
+
+        LoadInst *calleeValue = new LoadInst(
+          slot, Twine("CalleeArg_") + phi->getName(), where);
+        Value *recomputed = invertUpdate(update, calleeValue,
+          Twine("Recompute_") + phi->getName(), where);
+        new StoreInst(recomputed, slot, where);
+      }
+
+      // A rematerialized value may use another one,
+      // so operands are rematerialized first.
+      ValueList rematOrder;
+      {
+        DenseSet<const Value*> pending(rematHere.begin(), rematHere.end());
+        while( !pending.empty() )
+          for(VLI i=rematHere.begin(), e=rematHere.end(); i!=e; ++i)
+          {
+            const Instruction *lv = cast<Instruction>( *i );
+            if( !pending.count(lv) )
+              continue;
+
+            bool ready = true;
+            for(Instruction::const_op_iterator k=lv->op_begin(), g=lv->op_end(); k!=g; ++k)
+              if( pending.count(*k) )
+                ready = false;
+
+            if( ready )
+            {
+              rematOrder.push_back(lv);
+              pending.erase(lv);
+            }
+          }
+      }
+
       // Caller will rematerialize other live values.
-      for(VLI i=rematHere.begin(), e=rematHere.end(); i!=e; ++i)
+      for(VLI i=rematOrder.begin(), e=rematOrder.end(); i!=e; ++i)
       {
         const Value *lv = *i;
         LiveValueInfo &lvi = liveValues[lv];
@@ -9,10 +9,18 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Support/Debug.h"
 
 #include <list>
 
+#define DEBUG_TYPE "stack2static"
+
 using namespace llvm;
 using namespace std;
 
@@ -23,12 +31,18 @@ namespace corelab {
 			static char ID;
 			Stack2Static() : FunctionPass(ID) {}
 
+			virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+				AU.addRequired<LoopInfoWrapperPass>();
+				AU.addRequired<ScalarEvolutionWrapperPass>();
+			}
+
 			virtual bool runOnFunction(Function &F) {
 				bool modified = false;
 
 				modified = searchStackInst(&F);
 
 				if ( modified ) {
+					inferStackDepth(&F);
 					allocaStackSpace(&F);
 					transformIntrinsic(&F);
 				}
@@ -38,6 +52,9 @@ namespace corelab {
 
 		private:
 			bool searchStackInst(Function *);
+			void inferStackDepth(Function *);
+			unsigned getNestingDepth(Function *);
+			unsigned getTripCountDepth(Function *);
 			void allocaStackSpace(Function *);
 			void transformIntrinsic(Function *);
 
@@ -51,6 +68,10 @@ namespace corelab {
 			DenseMap<Function *, AllocaInst *> fcn2space;
 			DenseMap<Function *, Instruction *> fcn2offset;
 			DenseMap<Function *, Instruction *> fcn2baseAddr;
+
+			// stack entries of each function, overflow checked when the depth is unknown
+			DenseMap<Function *, unsigned> fcn2stackSize;
+			DenseSet<Function *> uncheckedFcn;
 	};
 }
 
@@ -62,7 +83,138 @@ static RegisterPass<Stack2Static> X("stack2static",
 
 cl::opt<unsigned> StackSize(
 		"stackSize", cl::init(100), cl::NotHidden,
-		cl::desc("Define Stack Nested Size"));
+		cl::desc("Stack Nested Size when the depth of a function is unknown or larger"));
+
+	// stacksave that a stackrestore goes back to, NULL when it can not be traced
+	static CallInst *getRestoredSave(CallInst *restoreInst) {
+		Value *operand = restoreInst->getArgOperand(0)->stripPointerCasts();
+		if ( CallInst *cInst = dyn_cast<CallInst>(operand) )
+			if ( Function *calledFunction = cInst->getCalledFunction() )
+				if ( calledFunction->getIntrinsicID() == Intrinsic::stacksave )
+					return cInst;
+		return NULL;
+	}
+
+	// Max nesting depth over the CFG : forward dataflow of the stack position,
+	// joined by max. stacksave pushes, stackrestore goes back to the position in
+	// front of its save ( an untraceable restore keeps the position, which only
+	// over-approximates ). Without growing cycles an active save appears once,
+	// so a position above the number of saves means the depth is not bounded
+	// by the CFG alone ( returns 0 ).
+	unsigned Stack2Static::getNestingDepth(Function *F) {
+		unsigned numOfSaves = saveInstList[F].size();
+
+		DenseMap<CallInst *, list<CallInst *>> save2restores;
+		for ( auto restoreInst : restoreInstList[F] )
+			if ( CallInst *saveInst = getRestoredSave(restoreInst) )
+				save2restores[saveInst].push_back(restoreInst);
+
+		DenseMap<CallInst *, unsigned> saveDepth;
+		DenseMap<BasicBlock *, unsigned> inDepth;
+		DenseSet<BasicBlock *> inWorklist;
+		list<BasicBlock *> worklist;
+
+		BasicBlock *entryBB = &F->getEntryBlock();
+		inDepth[entryBB] = 0;
+		worklist.push_back(entryBB);
+		inWorklist.insert(entryBB);
+
+		unsigned maxDepth = 0;
+		while ( !worklist.empty() ) {
+			BasicBlock *bb = worklist.front();
+			worklist.pop_front();
+			inWorklist.erase(bb);
+
+			unsigned depth = inDepth[bb];
+			for ( auto ii = bb->begin(); ii != bb->end(); ++ii )
+			{
+				CallInst *cInst = dyn_cast<CallInst>(&*ii);
+				if ( !cInst || !cInst->getCalledFunction() ) continue;
+
+				Intrinsic::ID id = cInst->getCalledFunction()->getIntrinsicID();
+				if ( id == Intrinsic::stacksave ) {
+					auto found = saveDepth.find(cInst);
+					if ( found == saveDepth.end() || found->second < depth ) {
+						saveDepth[cInst] = depth;
+						// restores to this save see the new position
+						for ( auto restoreInst : save2restores[cInst] )
+							if ( inWorklist.insert(restoreInst->getParent()).second )
+								worklist.push_back(restoreInst->getParent());
+					}
+					depth++;
+				}
+				else if ( id == Intrinsic::stackrestore ) {
+					if ( CallInst *saveInst = getRestoredSave(cInst) )
+						depth = saveDepth.lookup(saveInst);
+				}
+
+				if ( depth > numOfSaves )
+					return 0;
+				if ( maxDepth < depth )
+					maxDepth = depth;
+			}
+
+			for ( auto si = succ_begin(bb); si != succ_end(bb); ++si )
+			{
+				BasicBlock *succ = *si;
+				auto found = inDepth.find(succ);
+				if ( found != inDepth.end() && found->second >= depth ) continue;
+
+				inDepth[succ] = depth;
+				if ( inWorklist.insert(succ).second )
+					worklist.push_back(succ);
+			}
+		}
+
+		return maxDepth;
+	}
+
+	// A save in a loop nest executes at most the product of the max trip
+	// counts per call, the depth never exceeds the saves executed.
+	// 0 when a loop around a save has no constant bound.
+	unsigned Stack2Static::getTripCountDepth(Function *F) {
+		LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+		ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+		uint64_t depth = 0;
+		for ( auto saveInst : saveInstList[F] )
+		{
+			uint64_t executions = 1;
+			for ( Loop *loop = LI.getLoopFor(saveInst->getParent()); loop; loop = loop->getParentLoop() )
+			{
+				unsigned tripCount = SE.getSmallConstantMaxTripCount(loop);
+				if ( tripCount == 0 )
+					return 0;
+
+				executions *= tripCount;
+				if ( executions > StackSize )
+					return 0;
+			}
+
+			depth += executions;
+			if ( depth > StackSize )
+				return 0;
+		}
+		return depth;
+	}
+
+	// entry 0 is the frame of the function body, a save at depth d uses entry d + 1
+	void Stack2Static::inferStackDepth(Function *F) {
+		unsigned depth = getNestingDepth(F);
+		if ( depth == 0 )
+			depth = getTripCountDepth(F);
+
+		if ( depth == 0 || depth + 1 > StackSize ) {
+			fcn2stackSize[F] = StackSize;
+			uncheckedFcn.insert(F);
+			LLVM_DEBUG(dbgs() << "Stack2Static : " << F->getName()
+					<< " unknown depth, " << StackSize << " entries with overflow check\n");
+			return;
+		}
+
+		fcn2stackSize[F] = depth + 1;
+		LLVM_DEBUG(dbgs() << "Stack2Static : " << F->getName() << " depth " << depth << "\n");
+	}
 
 
 	bool Stack2Static::searchStackInst(Function *F) {
@@ -107,7 +259,7 @@ cl::opt<unsigned> StackSize(
 	void Stack2Static::allocaStackSpace(Function *F) {
 		AllocaInst *stackEntry = save2Alloca[(saveInstList[F]).front()];
 		Type *entryType = stackEntry->getAllocatedType();
-		ArrayType *stackSpaceType = ArrayType::get(entryType, StackSize);
+		ArrayType *stackSpaceType = ArrayType::get(entryType, fcn2stackSize[F]);
 
 		BasicBlock &entryBB = F->getEntryBlock();
 		Instruction *firstInst = &*(entryBB.begin());
@@ -181,6 +333,14 @@ cl::opt<unsigned> StackSize(
 				BinaryOperator::Create(Instruction::Add, positionLoad, 
 						ConstantInt::get(Type::getInt32Ty(ctx), 1), "NextPosition", saveInst);
 
+			if ( uncheckedFcn.count(F) ) {
+				// trap instead of writing past the stack space
+				Value *overflow = new ICmpInst(saveInst, ICmpInst::ICMP_UGE, nextPositionOffset,
+						ConstantInt::get(Type::getInt32Ty(ctx), fcn2stackSize[F]), "StackOverflow");
+				Instruction *thenTerm = SplitBlockAndInsertIfThen(overflow, saveInst, true);
+				CallInst::Create(Intrinsic::getDeclaration(F->getParent(), Intrinsic::trap), "", thenTerm);
+			}
+
 			StoreInst *positionStore = new StoreInst(nextPositionOffset, position, saveInst);
 
 			actuals[1] = nextPositionOffset;
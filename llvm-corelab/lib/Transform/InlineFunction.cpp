@@ -5,6 +5,8 @@
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Scalar/LoopUnrollPass.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/ADT/SCCIterator.h"
 
 #include "corelab/Transform/InlineFunction.h"
 
@@ -12,6 +14,7 @@
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
 
 using namespace llvm;
 using namespace corelab;
@@ -34,16 +37,27 @@ cl::opt<unsigned> OptSizeThreshold(
 		"opt-size-threshold", cl::init(50), cl::NotHidden,
 		cl::desc("Define Threshold for opt size attr"));
 
+cl::opt<bool> ProfileInline(
+		"inline-profile", cl::init(false), cl::NotHidden,
+		cl::desc("Inline hot call sites first using exectime call counts"));
 
-DenseMap<Function *, unsigned> func2loccopy;
+cl::opt<std::string> ProfileIDFile(
+		"inline-profile-id", cl::init("Function2ID.data"), cl::NotHidden,
+		cl::desc("Function ID file generated by -plain-exectime"));
+
+cl::opt<std::string> ProfileCountFile(
+		"inline-profile-count", cl::init("CallCount.data"), cl::NotHidden,
+		cl::desc("Call count file generated by exectime runtime"));
+
+cl::opt<unsigned> StateBudget(
+		"inline-state-budget", cl::init(200), cl::NotHidden,
+		cl::desc("Define total state increase allowed for profile guided inline"));
 
-bool compare_functions(Function *first, Function *second) {
-	return ( func2loccopy[first] < func2loccopy[second] );
-}
 
 void InlineSmallFunction::getAnalysisUsage( AnalysisUsage &AU ) const
 {
 	AU.addRequired< LoopInfoWrapperPass >();
+	AU.addRequired< CallGraphWrapperPass >();
 	AU.setPreservesAll();
 }
 
@@ -54,22 +68,117 @@ void InlineSmallFunction::setAttributeSize(Function *func) {
 	}
 }
 
-void InlineSmallFunction::smallFunctionSearch() {
+// One pass over the module : instruction count of every function and
+// callee -> call sites index. Kept up to date by updateCallSiteIndex.
+void InlineSmallFunction::buildCallSiteIndex() {
 	for ( auto fi = module->begin(); fi != module->end(); fi++ )
 	{
 		Function *func = &*fi;
-
-		if ( func->isDeclaration() || recursiveCheck(func) )
-			continue;
-
 		unsigned instructionCount = 0;
 
-		//Naive Implementation
 		for ( auto bi = func->begin(); bi != func->end(); bi++ )
 			for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
+			{
 				instructionCount++;
 
+				if ( !isa<CallInst>(&*ii) && !isa<InvokeInst>(&*ii) )
+					continue;
+
+				CallSite cs(&*ii);
+				if ( Function *callee = cs.getCalledFunction() ) {
+					func2callsite[callee].push_back(&*ii);
+					func2callsitenum[callee]++;
+				}
+			}
+
 		func2loc[func] = instructionCount;
+		func2halfstate[func] = countHalfStates(func);
+	}
+}
+
+void InlineSmallFunction::findRecursiveFunctions() {
+	CallGraph &cg = getAnalysis< CallGraphWrapperPass >().getCallGraph();
+
+	unsigned order = 0;
+	for ( scc_iterator<CallGraph *> si = scc_begin(&cg); !si.isAtEnd(); ++si )
+	{
+		for ( auto node : *si )
+			if ( Function *func = node->getFunction() )
+				func2order[func] = order++;
+
+		if ( !si.hasLoop() )
+			continue;
+
+		for ( auto node : *si )
+			if ( Function *func = node->getFunction() ) {
+				recursiveFunctions.insert(func);
+				if (debug) errs() << " Recursive Function exist : " << func->getName() << "\n";
+			}
+	}
+}
+
+// The inlined call site is gone, and the calls cloned from the callee body
+// are new call sites of their own callees.
+// ( InlinedCallSites : InlineFunction fills it when IFI has no call graph )
+void InlineSmallFunction::updateCallSiteIndex(Function *targets, InlineFunctionInfo &IFI) {
+	func2callsitenum[targets]--;
+
+	for ( auto cs : IFI.InlinedCallSites )
+	{
+		if ( Function *callee = cs.getCalledFunction() ) {
+			func2callsite[callee].push_back(cs.getInstruction());
+			func2callsitenum[callee]++;
+		}
+	}
+}
+
+// Every call site in the module must be in the index of its callee,
+// e.g. the calls cloned from a nested small callee after it was inlined.
+bool InlineSmallFunction::verifyCallSiteIndex() {
+	DenseMap<Function *, unsigned> callSiteNum;
+	bool valid = true;
+
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+		for ( auto bi = (&*fi)->begin(); bi != (&*fi)->end(); bi++ )
+			for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
+			{
+				if ( !isa<CallInst>(&*ii) && !isa<InvokeInst>(&*ii) )
+					continue;
+
+				CallSite cs(&*ii);
+				Function *callee = cs.getCalledFunction();
+				if ( !callee )
+					continue;
+
+				callSiteNum[callee]++;
+
+				list<Instruction *> &callSites = func2callsite[callee];
+				if ( std::find(callSites.begin(), callSites.end(), &*ii) == callSites.end() ) {
+					errs() << "call site of " << callee->getName() << " in "
+						<< (&*fi)->getName() << " is not indexed\n";
+					valid = false;
+				}
+			}
+
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+		if ( callSiteNum[&*fi] != func2callsitenum[&*fi] ) {
+			errs() << "call site count of " << (&*fi)->getName() << " : "
+				<< func2callsitenum[&*fi] << " / " << callSiteNum[&*fi] << "\n";
+			valid = false;
+		}
+
+	return valid;
+}
+
+void InlineSmallFunction::smallFunctionSearch() {
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+	{
+		Function *func = &*fi;
+
+		if ( func->isDeclaration() || recursiveCheck(func) )
+			continue;
+
+		unsigned instructionCount = func2loc[func];
 
 		if ( instructionCount < Threshold ) 
 			smallFunctions.push_back(func);
@@ -105,48 +214,33 @@ void InlineSmallFunction::smallFunctionSearch() {
 			*/
 		}
 	}
-
-	for ( auto fi = module->begin(); fi != module->end(); fi++ )
-		for ( auto bi = (&*fi)->begin(); bi != (&*fi)->end(); bi++ )
-			for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
-			{
-				if ( CallInst *cb = dyn_cast<CallInst>(&*ii) ) {
-					if ( Function *callee = cb->getCalledFunction() ) {
-						for ( auto targets : smallFunctions )
-							if ( targets == callee )
-								func2callsite[callee].push_back(&*ii);
-					}
-				}
-				else if ( InvokeInst *cb = dyn_cast<InvokeInst>(&*ii) ) {
-					if ( Function *callee = cb->getCalledFunction() ) {
-						for ( auto targets : smallFunctions )
-							if ( targets == callee )
-								func2callsite[callee].push_back(&*ii);
-					}
-				}
-			}
 }
 
-unsigned InlineSmallFunction::getStateCount(Function *func) {
-	unsigned naiveStateCount = 0;
-	float naiveFloat = 0;
+unsigned InlineSmallFunction::countHalfStates(Function *func) {
+	unsigned naiveHalf = 0;
 	for ( auto bi = func->begin(); bi != func->end(); )
 	{
 		for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
 		{
 			Instruction *inst = &*ii;
 			if ( isa<CallInst>(inst) || isa<InvokeInst>(inst) )
-				naiveFloat = naiveFloat + 2;
+				naiveHalf = naiveHalf + 2;
 			else if ( isa<StoreInst>(inst) || isa<LoadInst>(inst) )
-				naiveFloat = naiveFloat + 1;
+				naiveHalf = naiveHalf + 1;
 		}
 
 		if ( ++bi != func->end() )
-			naiveFloat = naiveFloat + 2;
+			naiveHalf = naiveHalf + 2;
 	}
 
-	naiveStateCount = (naiveFloat/2);
-	return naiveStateCount;
+	return naiveHalf;
+}
+
+unsigned InlineSmallFunction::getStateCount(Function *func) {
+	if ( !func2halfstate.count(func) )
+		func2halfstate[func] = countHalfStates(func);
+
+	return func2halfstate[func] / 2;
 }
 
 
@@ -266,39 +360,17 @@ bool InlineSmallFunction::checkInlinePossible(Function *targets) {
 //	return !callerLargeState & !calleeLargeState;
 }
 
-void InlineSmallFunction::updateLOC(Function *caller) {
-	unsigned instructionCount = 0;
-	for ( auto bi = caller->begin(); bi != caller->end(); bi++ )
-		for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
-			instructionCount++;
-	func2loc[caller] = instructionCount;
+// Incremental cost of caller after one call site of callee is inlined.
+// The call is replaced by the callee body, and the call block is split,
+// so the last callee block is not the last block anymore ( +1 state ).
+void InlineSmallFunction::updateCost(Function *caller, Function *callee) {
+	func2loc[caller] = func2loc[caller] + func2loc[callee] - 1;
+	func2halfstate[caller] = func2halfstate[caller] + func2halfstate[callee] + 2;
 }
 
 
 bool InlineSmallFunction::uniqueFunctionSearch(Function *calleeCheck) {
-	unsigned callnum = 0;
-
-	for ( auto fii = module->begin(); fii != module->end(); fii++ )
-		for ( auto bi = (&*fii)->begin(); bi != (&*fii)->end(); bi++ )
-			for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
-			{
-				if (  CallInst *cb = dyn_cast<CallInst>(&*ii) ) {
-					if ( Function *callee = cb->getCalledFunction() ) {
-						if ( calleeCheck == callee ) {
-							callnum++;
-						}
-					}
-				}
-				else if ( InvokeInst *cb = dyn_cast<InvokeInst>(&*ii) ) {
-					if ( Function *callee = cb->getCalledFunction() ) {
-						if ( calleeCheck == callee ) {
-							callnum++;
-						}
-					}
-				}
-			}
-
-	if ( callnum == 1 ) 
+	if ( func2callsitenum.count(calleeCheck) && func2callsitenum[calleeCheck] == 1 )
 		return true;
 	else
 		return false;
@@ -315,7 +387,10 @@ void InlineSmallFunction::makeInline() {
 			continue;
 		}
 
-		for ( auto callsites : func2callsite[targets] )
+		list<Instruction *> callSites = func2callsite[targets];
+		func2callsite[targets].clear();
+
+		for ( auto callsites : callSites )
 		{
 			assert(callsites);
 			Function *caller = callsites->getFunction();
@@ -325,13 +400,14 @@ void InlineSmallFunction::makeInline() {
 			CallSite cs(callsites);
 			if ( InlineFunction(cs, IFI) ) {
 				if (debug) errs() << "succ";
+				updateCallSiteIndex(targets, IFI);
+				updateCost(caller, targets);
 			}
 			else {
 				if (debug) errs() << "fail";
+				func2callsite[targets].push_back(callsites);
 			}
 			
-
-			updateLOC(caller);
 			if (debug) errs() << "\n";
 		}
 		if (debug) errs() << "\n";
@@ -343,28 +419,140 @@ void InlineSmallFunction::makeInline() {
 //}
 
 bool InlineSmallFunction::recursiveCheck(Function *func) {
-	bool hasRecur = false;
-	for ( auto bi = (func)->begin(); bi != (func)->end(); bi++ )
-		for ( auto ii = (&*bi)->begin(); ii != (&*bi)->end(); ii++ )
+	return recursiveFunctions.count(func);
+}
+
+//Function2ID.data : "name\t:\tid", CallCount.data : "FunctionID id\t:\tcount"
+bool InlineSmallFunction::loadProfile() {
+	DenseMap<int, Function *> id2func;
+	string line;
+
+	ifstream idFile(ProfileIDFile.c_str());
+	if ( !idFile.is_open() )
+		return false;
+
+	while ( getline(idFile, line) ) {
+		size_t pos = line.find("\t:\t");
+		if ( pos == string::npos )
+			continue;
+
+		if ( Function *func = module->getFunction(line.substr(0, pos)) )
+			id2func[std::stoi(line.substr(pos+3))] = func;
+	}
+	idFile.close();
+
+	ifstream countFile(ProfileCountFile.c_str());
+	if ( !countFile.is_open() )
+		return false;
+
+	const string prefix = "FunctionID ";
+	while ( getline(countFile, line) ) {
+		size_t pos = line.find("\t:\t");
+		if ( pos == string::npos || line.compare(0, prefix.size(), prefix) != 0 )
+			continue;
+
+		int id = std::stoi(line.substr(prefix.size(), pos - prefix.size()));
+		if ( id2func.count(id) )
+			func2freq[id2func[id]] = std::stoull(line.substr(pos+3));
+	}
+	countFile.close();
+
+	return true;
+}
+
+void InlineSmallFunction::getCallSites(Function *func, list<Instruction *> &callSites) {
+	if ( func2callsite.count(func) )
+		callSites = func2callsite[func];
+}
+
+// Rank callees by (call count * callee cost) and inline the hottest first
+// until the total state increase reaches StateBudget.
+// Cold callees (never called in the profile run) are not inlined.
+void InlineSmallFunction::profileGuidedInline() {
+	vector<pair<uint64_t, Function *>> candidates;
+
+	for ( auto fi = module->begin(); fi != module->end(); fi++ )
+	{
+		Function *func = &*fi;
+
+		if ( func->isDeclaration() || recursiveCheck(func) || isNoInline(func) )
+			continue;
+
+		if ( !func2freq.count(func) || func2freq[func] == 0 )
+			continue;
+
+		// one more state for call & return
+		uint64_t score = func2freq[func] * (getStateCount(func) + 1);
+		candidates.push_back(make_pair(score, func));
+
+		if (debug) errs() << "profile : " << func->getName() << " : " << func2freq[func]
+			<< " : " << getStateCount(func) << " : " << score << "\n";
+	}
+
+	std::stable_sort(candidates.begin(), candidates.end(),
+			[](const pair<uint64_t, Function *> &a, const pair<uint64_t, Function *> &b) {
+				return a.first > b.first;
+			});
+
+	unsigned budget = StateBudget;
+	for ( auto iter : candidates )
+	{
+		Function *targets = iter.second;
+
+		list<Instruction *> callSites;
+		getCallSites(targets, callSites);
+		if ( callSites.empty() )
+			continue;
+
+		if (debug) errs() << "Inline Try : " << targets->getName() << "\n";
+
+		unsigned calleeState = getStateCount(targets);
+		unsigned growth = calleeState * callSites.size();
+		if ( budget < growth ) {
+			if (debug) errs() << "Out of State Budget ( " << budget << " < " << growth << " )\n\n";
+			continue;
+		}
+
+		DenseMap<Function *, unsigned> caller2numofcall;
+		for ( auto callsites : callSites )
+			caller2numofcall[callsites->getFunction()]++;
+
+		bool tooLarge = false;
+		for ( auto caller : caller2numofcall )
+			if ( LargeThreshold < getStateCount(caller.first) + (calleeState * caller.second) ) {
+				if (debug) errs() << "caller(" << caller.first->getName() << ") has Large State already\n";
+				tooLarge = true;
+			}
+
+		if ( tooLarge ) {
+			if (debug) errs() << "Not Possible\n\n";
+			continue;
+		}
+
+		func2callsite[targets].clear();
+
+		for ( auto callsites : callSites )
 		{
-			if (  CallInst *cb = dyn_cast<CallInst>(&*ii) ) {
-				if ( Function *callee = cb->getCalledFunction() ) 
-					if ( func == callee ) {
-						hasRecur = true;
-					}
+			Function *caller = callsites->getFunction();
+
+			InlineFunctionInfo IFI;
+			CallSite cs(callsites);
+			if ( InlineFunction(cs, IFI) ) {
+				if (debug) errs() << "succ";
+				updateCallSiteIndex(targets, IFI);
+				updateCost(caller, targets);
 			}
-			else if ( InvokeInst *cb = dyn_cast<InvokeInst>(&*ii) ) {
-				if ( Function *callee = cb->getCalledFunction() ) 
-					if ( func == callee ) {
-						hasRecur = true;
-					}
+			else {
+				if (debug) errs() << "fail";
+				func2callsite[targets].push_back(callsites);
 			}
-		}
 
-	if ( hasRecur )
-		if (debug) errs() << " Recursive Function exist : " << func->getName() << "\n";
+			if (debug) errs() << "\n";
+		}
 
-	return hasRecur;
+		budget -= growth;
+		if (debug) errs() << "Remain State Budget : " << budget << "\n\n";
+	}
 }
 
 bool InlineSmallFunction::runOnModule(Module& M) {
@@ -373,15 +561,33 @@ bool InlineSmallFunction::runOnModule(Module& M) {
 
 	module = &M;
 
+	findRecursiveFunctions();
+	buildCallSiteIndex();
+
+	if ( ProfileInline ) {
+		if ( loadProfile() ) {
+			profileGuidedInline();
+			if (debug) assert(verifyCallSiteIndex() && "stale call site index");
+
+			if (debug) errs() << "\n@@@@@@@@@@ Inline Transformation END @@@@@@@@@@@@@@\n";
+			return true;
+		}
+		errs() << "Can not find profile ( " << ProfileIDFile << ", " << ProfileCountFile
+			<< " ), fall back to size based inline\n";
+	}
+
 	smallFunctionSearch();
 
 	if (debug) errs() << "\n";
 
-	func2loccopy.clear();
-	func2loccopy = func2loc;
-	smallFunctions.sort(compare_functions);
+	// bottom up : callees are inlined into their callers before the callers
+	// themselves are considered, so nested small callees are inlined once
+	smallFunctions.sort([this](Function *first, Function *second) {
+			return ( func2order[first] < func2order[second] );
+			});
 
 	makeInline();
+	if (debug) assert(verifyCallSiteIndex() && "stale call site index");
 
 	if (debug) errs() << "\n@@@@@@@@@@ Inline Transformation END @@@@@@@@@@@@@@\n";
 
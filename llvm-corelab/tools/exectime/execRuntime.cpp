@@ -10,6 +10,7 @@
 
 std::unordered_map<int, double> *execTimeOfFunction;
 std::unordered_map<int, double> *tmpTimeOfFunction;
+std::unordered_map<int, unsigned long> *callCountOfFunction;
 std::list<int> *functionStack;
 
 x86timer *t;
@@ -21,6 +22,7 @@ void plainExecInitialize(int mainID, int nContext) {
 
 	execTimeOfFunction = new std::unordered_map<int, double>();
 	tmpTimeOfFunction = new std::unordered_map<int, double>();
+	callCountOfFunction = new std::unordered_map<int, unsigned long>();
 	functionStack = new std::list<int>();
 	t = new x86timer();
 
@@ -28,7 +30,9 @@ void plainExecInitialize(int mainID, int nContext) {
 	{
 		(*execTimeOfFunction)[i] = 0.0;
 		(*tmpTimeOfFunction)[i] = 0.0;
+		(*callCountOfFunction)[i] = 0;
 	}
+	(*callCountOfFunction)[mainID] = 1;
 	
 	(*tmpTimeOfFunction)[mainID] = t->now();
 	total_time = (*tmpTimeOfFunction)[mainID];
@@ -59,12 +63,24 @@ void plainExecFinalize(int mainID, int nContext, int accum) {
 		execfile << "FunctionID " << i << "\t:\t" << (*execTimeOfFunction)[i] << "\n";
 
 	execfile.close();
+
+	//call frequency (used by profile guided inlining)
+	std::ofstream countfile("CallCount.data", std::ios::out | std::ofstream::binary);
+
+	countfile << "Function Call Count\n\n";
+
+	for (int i=1; i <= nContext; i++)
+		countfile << "FunctionID " << i << "\t:\t" << (*callCountOfFunction)[i] << "\n";
+
+	countfile.close();
 }
 
 
 extern "C"
 void plainExecCallSiteBegin (int funcID, int accum) {
 	
+	(*callCountOfFunction)[funcID]++;
+
 	if ( accum == 0 )
 		(*functionStack).push_back(funcID);
 
@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "../memoryStatePrinter/memoryStateFormat.h"
+#include "../memoryStatePrinter/memoryStateLZ.h"
+
+// Decoder / diff of memoryStatePrinter binary dumps
+//
+//   memoryStateDiff dump.bin           : print in the text format of printBits
+//   memoryStateDiff golden.bin dut.bin : report the first differing elements
+//   memoryStateDiff -full delta.bin full.bin : rebuild a full dump from a delta dump
+//
+// delta records are applied to the previous image of the same id while reading,
+// so every record is seen as a full image.
+// Elements follow printBits : a struct memory is split into its fields by the
+// layout record of its id, pointers ( width 2 ) print as PPPPPPPP and are never
+// compared, their value differs run by run.
+
+#define MAX_REPORT 16
+
+struct Record {
+	uint32_t tag;
+	std::string name;
+	struct MSPMemoryHeader memory;
+	const uint8_t *data;
+
+	struct MSPObjectHeader object;
+
+	struct MSPLayoutHeader layout;
+
+	struct MSPTraceHeader trace;
+	const struct MSPTraceEntry *entries;
+};
+
+struct Layout {
+	struct MSPLayoutHeader header;
+	std::vector<struct MSPLayoutField> fields;
+};
+
+// a scalar of an image
+struct Element {
+	uint64_t offset;
+	int bytes;
+	bool isPointer;
+};
+
+class DumpReader {
+	public:
+		bool open(const char *fileName) {
+			FILE *file = fopen(fileName, "rb");
+			if ( file == NULL ) {
+				fprintf(stderr, "can not open %s\n", fileName);
+				return false;
+			}
+
+			fseek(file, 0, SEEK_END);
+			long fileSize = ftell(file);
+			fseek(file, 0, SEEK_SET);
+
+			buffer.resize(fileSize);
+			if ( fileSize != 0 && fread(&buffer[0], 1, fileSize, file) != (size_t)fileSize ) {
+				fclose(file);
+				return false;
+			}
+			fclose(file);
+
+			struct MSPFileHeader fileHeader;
+			pos = 0;
+			if ( !read(&fileHeader, sizeof(fileHeader)) || fileHeader.magic != MSP_MAGIC ) {
+				fprintf(stderr, "%s is not a memory state dump\n", fileName);
+				return false;
+			}
+
+			if ( (fileHeader.version & MSP_COMPRESSED) && !decompress() ) {
+				fprintf(stderr, "%s has a broken chunk\n", fileName);
+				return false;
+			}
+			return true;
+		}
+
+		bool next(Record &record) {
+			struct MSPRecordHeader recordHeader;
+			if ( !read(&recordHeader, sizeof(recordHeader)) )
+				return false;
+
+			if ( pos + recordHeader.nameLength > buffer.size() )
+				return false;
+			record.tag = recordHeader.tag;
+			record.name.assign((const char *)&buffer[pos], recordHeader.nameLength);
+			pos += recordHeader.nameLength;
+
+			if ( record.tag == MSP_MEMORY ) {
+				if ( !read(&record.memory, sizeof(record.memory))
+						|| pos + record.memory.size > buffer.size() )
+					return false;
+				record.data = &buffer[pos];
+				pos += record.memory.size;
+
+				id2image[record.memory.id].assign(record.data, record.data + record.memory.size);
+			}
+			else if ( record.tag == MSP_DELTA ) {
+				struct MSPDeltaHeader deltaHeader;
+				if ( !read(&record.memory, sizeof(record.memory))
+						|| !read(&deltaHeader, sizeof(deltaHeader)) )
+					return false;
+
+				std::vector<uint8_t> &image = id2image[record.memory.id];
+				if ( image.size() != record.memory.size ) {
+					fprintf(stderr, "delta of %s without a full image\n", record.name.c_str());
+					return false;
+				}
+
+				for ( uint32_t i = 0; i < deltaHeader.numOfRanges; i++ )
+				{
+					struct MSPDeltaRange range;
+					if ( !read(&range, sizeof(range)) || range.offset + range.length > image.size()
+							|| !read(&image[range.offset], range.length) )
+						return false;
+				}
+
+				record.tag = MSP_MEMORY;
+				record.data = image.empty() ? NULL : &image[0];
+			}
+			else if ( record.tag == MSP_LAYOUT ) {
+				if ( !read(&record.layout, sizeof(record.layout)) )
+					return false;
+
+				Layout &layout = id2layout[record.layout.id];
+				layout.header = record.layout;
+				layout.fields.resize(record.layout.numOfFields);
+				if ( record.layout.numOfFields != 0 && !read(&layout.fields[0],
+							record.layout.numOfFields * sizeof(struct MSPLayoutField)) )
+					return false;
+			}
+			else if ( record.tag == MSP_OBJECT ) {
+				if ( !read(&record.object, sizeof(record.object)) )
+					return false;
+				id2name[record.object.id] = record.name;
+			}
+			else if ( record.tag == MSP_STORE_TRACE ) {
+				if ( !read(&record.trace, sizeof(record.trace))
+						|| pos + record.trace.numOfEntries * sizeof(struct MSPTraceEntry) > buffer.size() )
+					return false;
+				record.entries = (const struct MSPTraceEntry *)&buffer[pos];
+				pos += record.trace.numOfEntries * sizeof(struct MSPTraceEntry);
+			}
+			else if ( record.tag != MSP_FUNCTION_END ) {
+				fprintf(stderr, "unknown record %u\n", record.tag);
+				return false;
+			}
+
+			return true;
+		}
+
+		std::string getObjectName(uint32_t id) {
+			if ( id2name.count(id) )
+				return id2name[id];
+			return "";
+		}
+
+		const Layout *getLayout(uint32_t id) {
+			if ( id2layout.count(id) )
+				return &id2layout[id];
+			return NULL;
+		}
+
+	private:
+		// chunks after the file header are joined back into one record stream
+		bool decompress() {
+			std::vector<uint8_t> stream;
+			struct MSPChunkHeader chunkHeader;
+
+			while ( read(&chunkHeader, sizeof(chunkHeader)) ) {
+				if ( pos + chunkHeader.compressedSize > buffer.size() )
+					return false;
+
+				size_t streamSize = stream.size();
+				stream.resize(streamSize + chunkHeader.rawSize);
+
+				if ( chunkHeader.compressedSize == chunkHeader.rawSize )
+					memcpy(&stream[streamSize], &buffer[pos], chunkHeader.rawSize);
+				else if ( !mspDecompress(&buffer[pos], chunkHeader.compressedSize,
+							&stream[streamSize], chunkHeader.rawSize) )
+					return false;
+
+				pos += chunkHeader.compressedSize;
+			}
+
+			buffer.swap(stream);
+			pos = 0;
+			return true;
+		}
+
+		bool read(void *dst, size_t size) {
+			if ( pos + size > buffer.size() )
+				return false;
+			memcpy(dst, &buffer[pos], size);
+			pos += size;
+			return true;
+		}
+
+		std::vector<uint8_t> buffer;
+		size_t pos;
+
+		// last image of each object, base of the next delta
+		std::map<uint32_t, std::vector<uint8_t> > id2image;
+
+		// names of traced objects
+		std::map<uint32_t, std::string> id2name;
+
+		// fields of struct memories
+		std::map<uint32_t, Layout> id2layout;
+};
+
+static void addElement(std::vector<Element> &elements, uint64_t offset, int bytes, bool isPointer)
+{
+	// wider than a word ( long double, .. ) : byte by byte
+	if ( bytes != 1 && bytes != 2 && bytes != 4 && bytes != 8 && !isPointer ) {
+		for ( int i = 0; i < bytes; i++ )
+			addElement(elements, offset + i, 1, false);
+		return;
+	}
+
+	Element element = { offset, bytes, isPointer };
+	elements.push_back(element);
+}
+
+// scalars of an image : the fields of each struct by its layout, else
+// numOfElements of dataWidth ( a non uniform image is shown byte by byte )
+static void getElements(DumpReader &reader, const Record &record, std::vector<Element> &elements)
+{
+	elements.clear();
+
+	if ( const Layout *layout = reader.getLayout(record.memory.id) ) {
+		uint64_t stride = layout->header.stride;
+		for ( uint64_t base = 0; stride != 0 && base + stride <= record.memory.size; base += stride )
+			for ( auto &field : layout->fields )
+			{
+				if ( field.width == MSP_POINTER_WIDTH )
+					addElement(elements, base + field.offset, layout->header.pointerBytes, true);
+				else
+					addElement(elements, base + field.offset, (field.width + 7) / 8, false);
+			}
+		return;
+	}
+
+	bool isPointer = record.memory.dataWidth == MSP_POINTER_WIDTH;
+	int bytes = isPointer ? sizeof(void *) : record.memory.dataWidth / 8;
+	if ( bytes == 0 || (uint64_t)bytes * record.memory.numOfElements != record.memory.size ) {
+		bytes = 1;
+		isPointer = false;
+	}
+
+	for ( uint64_t offset = 0; offset + bytes <= record.memory.size; offset += bytes )
+		addElement(elements, offset, bytes, isPointer);
+}
+
+static uint64_t getElement(const uint8_t *data, const Element &element)
+{
+	uint64_t value = 0;
+	memcpy(&value, data + element.offset, element.bytes);
+	return value;
+}
+
+static void printElement(const uint8_t *data, const Element &element)
+{
+	if ( element.isPointer )
+		printf("PPPPPPPP");
+	else
+		printf("%0*llx", element.bytes * 2, (unsigned long long)getElement(data, element));
+}
+
+static void printEntry(DumpReader &reader, const struct MSPTraceEntry &entry)
+{
+	if ( entry.id == 0 )
+		printf("0x%llx", (unsigned long long)entry.offset);
+	else
+		printf("%s+%llu", reader.getObjectName(entry.id).c_str(), (unsigned long long)entry.offset);
+
+	if ( entry.width == MSP_POINTER_WIDTH )
+		printf("\t%u\tPPPPPPPP\n", entry.width);
+	else
+		printf("\t%u\t%0*llx\n", entry.width, (entry.width + 3) / 4, (unsigned long long)entry.value);
+}
+
+// a stored pointer only has to be a pointer in both, a store out of every
+// known object ( id 0 ) has only its raw address, which differs run by run
+static bool sameEntry(const struct MSPTraceEntry &golden, const struct MSPTraceEntry &dut)
+{
+	if ( golden.id != dut.id || golden.width != dut.width )
+		return false;
+	if ( golden.id != 0 && golden.offset != dut.offset )
+		return false;
+	return golden.width == MSP_POINTER_WIDTH || golden.value == dut.value;
+}
+
+static void printRecord(DumpReader &reader, const Record &record)
+{
+	if ( record.tag == MSP_FUNCTION_END ) {
+		printf("Function %s End\n\n", record.name.c_str());
+		return;
+	}
+	else if ( record.tag == MSP_OBJECT || record.tag == MSP_LAYOUT )
+		return;
+	else if ( record.tag == MSP_STORE_TRACE ) {
+		printf("Store Trace ( thread %u )\n", record.trace.threadId);
+		for ( uint32_t i = 0; i < record.trace.numOfEntries; i++ )
+			printEntry(reader, record.entries[i]);
+		printf("\n");
+		return;
+	}
+
+	printf("%s\n", record.name.c_str());
+
+	std::vector<Element> elements;
+	getElements(reader, record, elements);
+	for ( auto &element : elements )
+	{
+		printElement(record.data, element);
+		printf("\n");
+	}
+
+	printf("\n");
+}
+
+static int decode(const char *fileName)
+{
+	DumpReader reader;
+	if ( !reader.open(fileName) )
+		return 2;
+
+	Record record;
+	while ( reader.next(record) )
+		printRecord(reader, record);
+
+	return 0;
+}
+
+// stores of each thread in program order
+typedef std::map<uint32_t, std::vector<struct MSPTraceEntry> > ThreadTraces;
+
+// Trace records are written whenever a thread buffer fills up, so they
+// interleave with the images ( and each other ) by timing only. They are
+// taken out of the record stream and joined per thread; object names
+// come with them.
+static bool nextImage(DumpReader &reader, Record &record, ThreadTraces &traces)
+{
+	while ( reader.next(record) ) {
+		if ( record.tag == MSP_STORE_TRACE ) {
+			std::vector<struct MSPTraceEntry> &entries = traces[record.trace.threadId];
+			entries.insert(entries.end(), record.entries, record.entries + record.trace.numOfEntries);
+		}
+		else if ( record.tag != MSP_OBJECT )
+			return true;
+	}
+	return false;
+}
+
+static unsigned diffTraces(DumpReader &golden, ThreadTraces &goldenTraces,
+		DumpReader &dut, ThreadTraces &dutTraces)
+{
+	unsigned numOfDiffs = 0;
+
+	std::set<uint32_t> threadIds;
+	for ( auto &trace : goldenTraces )
+		threadIds.insert(trace.first);
+	for ( auto &trace : dutTraces )
+		threadIds.insert(trace.first);
+
+	for ( auto threadId : threadIds )
+	{
+		std::vector<struct MSPTraceEntry> &goldenEntries = goldenTraces[threadId];
+		std::vector<struct MSPTraceEntry> &dutEntries = dutTraces[threadId];
+		size_t goldenNum = goldenEntries.size();
+		size_t dutNum = dutEntries.size();
+		unsigned reported = 0;
+
+		for ( size_t i = 0; i < goldenNum || i < dutNum; i++ )
+		{
+			if ( i < goldenNum && i < dutNum && sameEntry(goldenEntries[i], dutEntries[i]) )
+				continue;
+
+			numOfDiffs++;
+			if ( reported++ >= MAX_REPORT )
+				continue;
+
+			printf("store %llu of thread %u :\n", (unsigned long long)i, threadId);
+			if ( i < goldenNum ) {
+				printf("\t");
+				printEntry(golden, goldenEntries[i]);
+			}
+			if ( i < dutNum ) {
+				printf("\t");
+				printEntry(dut, dutEntries[i]);
+			}
+		}
+	}
+
+	return numOfDiffs;
+}
+
+static int diff(const char *goldenName, const char *dutName)
+{
+	DumpReader golden, dut;
+	if ( !golden.open(goldenName) || !dut.open(dutName) )
+		return 2;
+
+	Record goldenRecord, dutRecord;
+	std::string lastFunction = "( start )";
+	unsigned numOfDiffs = 0;
+	ThreadTraces goldenTraces, dutTraces;
+
+	while ( 1 ) {
+		bool hasGolden = nextImage(golden, goldenRecord, goldenTraces);
+		bool hasDut = nextImage(dut, dutRecord, dutTraces);
+
+		if ( !hasGolden || !hasDut ) {
+			if ( hasGolden != hasDut ) {
+				printf("%s ends after %s\n", hasGolden ? dutName : goldenName, lastFunction.c_str());
+				numOfDiffs++;
+			}
+			break;
+		}
+
+		if ( goldenRecord.tag != dutRecord.tag || goldenRecord.name != dutRecord.name ) {
+			printf("record mismatch after %s : %s / %s\n", lastFunction.c_str(),
+					goldenRecord.name.c_str(), dutRecord.name.c_str());
+			numOfDiffs++;
+			break;
+		}
+
+		if ( goldenRecord.tag == MSP_FUNCTION_END ) {
+			lastFunction = goldenRecord.name;
+			continue;
+		}
+		else if ( goldenRecord.tag == MSP_LAYOUT )
+			continue;
+
+		if ( goldenRecord.memory.size != dutRecord.memory.size ) {
+			printf("%s at %s End : size %llu / %llu\n", goldenRecord.name.c_str(), lastFunction.c_str(),
+					(unsigned long long)goldenRecord.memory.size, (unsigned long long)dutRecord.memory.size);
+			numOfDiffs++;
+			continue;
+		}
+
+		if ( memcmp(goldenRecord.data, dutRecord.data, goldenRecord.memory.size) == 0 )
+			continue;
+
+		std::vector<Element> elements;
+		getElements(golden, goldenRecord, elements);
+
+		unsigned reported = 0;
+		for ( uint64_t i = 0; i < elements.size(); i++ )
+		{
+			const Element &element = elements[i];
+			if ( element.isPointer
+					|| getElement(goldenRecord.data, element) == getElement(dutRecord.data, element) )
+				continue;
+
+			numOfDiffs++;
+			if ( reported++ < MAX_REPORT ) {
+				printf("%s at %s End [%llu] : ", goldenRecord.name.c_str(),
+						lastFunction.c_str(), (unsigned long long)i);
+				printElement(goldenRecord.data, element);
+				printf(" / ");
+				printElement(dutRecord.data, element);
+				printf("\n");
+			}
+		}
+	}
+
+	// the rest of the traces, written at the exit of each thread
+	while ( nextImage(golden, goldenRecord, goldenTraces) );
+	while ( nextImage(dut, dutRecord, dutTraces) );
+	numOfDiffs += diffTraces(golden, goldenTraces, dut, dutTraces);
+
+	printf("%u differences\n", numOfDiffs);
+	return numOfDiffs ? 1 : 0;
+}
+
+static int rebuild(const char *deltaName, const char *fullName)
+{
+	DumpReader reader;
+	if ( !reader.open(deltaName) )
+		return 2;
+
+	FILE *file = fopen(fullName, "wb");
+	if ( file == NULL ) {
+		fprintf(stderr, "can not open %s\n", fullName);
+		return 2;
+	}
+
+	struct MSPFileHeader fileHeader = { MSP_MAGIC, MSP_VERSION };
+	fwrite(&fileHeader, sizeof(fileHeader), 1, file);
+
+	Record record;
+	while ( reader.next(record) ) {
+		struct MSPRecordHeader recordHeader;
+		recordHeader.tag = record.tag;
+		recordHeader.nameLength = record.name.size();
+		fwrite(&recordHeader, sizeof(recordHeader), 1, file);
+		fwrite(record.name.data(), 1, record.name.size(), file);
+
+		if ( record.tag == MSP_MEMORY ) {
+			fwrite(&record.memory, sizeof(record.memory), 1, file);
+			fwrite(record.data, 1, record.memory.size, file);
+		}
+		else if ( record.tag == MSP_OBJECT )
+			fwrite(&record.object, sizeof(record.object), 1, file);
+		else if ( record.tag == MSP_LAYOUT ) {
+			const Layout *layout = reader.getLayout(record.layout.id);
+			fwrite(&record.layout, sizeof(record.layout), 1, file);
+			if ( !layout->fields.empty() )
+				fwrite(&layout->fields[0], sizeof(struct MSPLayoutField), layout->fields.size(), file);
+		}
+		else if ( record.tag == MSP_STORE_TRACE ) {
+			fwrite(&record.trace, sizeof(record.trace), 1, file);
+			fwrite(record.entries, sizeof(struct MSPTraceEntry), record.trace.numOfEntries, file);
+		}
+	}
+
+	fclose(file);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if ( argc == 4 && strcmp(argv[1], "-full") == 0 )
+		return rebuild(argv[2], argv[3]);
+	else if ( argc == 2 )
+		return decode(argv[1]);
+	else if ( argc == 3 )
+		return diff(argv[1], argv[2]);
+
+	fprintf(stderr, "usage : %s dump.bin [other.bin]\n", argv[0]);
+	fprintf(stderr, "        %s -full delta.bin full.bin\n", argv[0]);
+	return 2;
+}
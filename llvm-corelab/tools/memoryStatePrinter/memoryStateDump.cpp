@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "memoryStatePrinter.h"
+#include "memoryStateFormat.h"
+#include "memoryStateLZ.h"
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+// Binary dump mode : raw memory images go to one fully buffered file
+// instead of a formatted line per element on stderr.
+//
+// MSP_ASYNC=1    : the program thread only copies records into chunks,
+//                  a writer thread takes them through a bounded lock free
+//                  queue and writes them to the file.
+// MSP_COMPRESS=1 : ( implies MSP_ASYNC ) the writer compresses each chunk.
+
+#define MSP_BUFFER_SIZE (4 << 20)
+#define MSP_QUEUE_SIZE 64
+
+static FILE *dumpFile = NULL;
+
+// a record is written as a whole, store traces come from any thread
+static std::recursive_mutex dumpLock;
+
+struct Chunk {
+	size_t size;
+	uint8_t data[MSP_CHUNK_SIZE];
+};
+
+// bounded MPMC ring : a cell is free for the producer of round n when its
+// sequence is n, and ready for the consumer when it is n + 1
+class ChunkQueue {
+	public:
+		ChunkQueue() : enqueuePos(0), dequeuePos(0) {
+			for ( size_t i = 0; i < MSP_QUEUE_SIZE; i++ )
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		bool push(struct Chunk *chunk) {
+			size_t pos = enqueuePos.load(std::memory_order_relaxed);
+			while ( 1 ) {
+				Cell *cell = &cells[pos % MSP_QUEUE_SIZE];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+
+				if ( sequence == pos ) {
+					if ( enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ) {
+						cell->chunk = chunk;
+						cell->sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if ( sequence < pos )
+					return false; // full
+				else
+					pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		bool pop(struct Chunk **chunk) {
+			size_t pos = dequeuePos.load(std::memory_order_relaxed);
+			while ( 1 ) {
+				Cell *cell = &cells[pos % MSP_QUEUE_SIZE];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+
+				if ( sequence == pos + 1 ) {
+					if ( dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ) {
+						*chunk = cell->chunk;
+						cell->sequence.store(pos + MSP_QUEUE_SIZE, std::memory_order_release);
+						return true;
+					}
+				}
+				else if ( sequence < pos + 1 )
+					return false; // empty
+				else
+					pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+	private:
+		struct Cell {
+			std::atomic<size_t> sequence;
+			struct Chunk *chunk;
+		};
+
+		Cell cells[MSP_QUEUE_SIZE];
+		std::atomic<size_t> enqueuePos;
+		std::atomic<size_t> dequeuePos;
+};
+
+static bool asyncWrite = false;
+static bool compressWrite = false;
+static ChunkQueue chunkQueue;
+static std::thread *writerThread = NULL;
+static struct Chunk *currentChunk = NULL;
+
+static void writeChunk (struct Chunk *chunk)
+{
+	if ( !compressWrite ) {
+		fwrite(chunk->data, 1, chunk->size, dumpFile);
+		return;
+	}
+
+	static uint8_t compressed[MSP_LZ_BOUND(MSP_CHUNK_SIZE)];
+	struct MSPChunkHeader chunkHeader;
+	chunkHeader.rawSize = chunk->size;
+	chunkHeader.compressedSize = mspCompress(chunk->data, chunk->size, compressed);
+
+	if ( chunkHeader.compressedSize >= chunkHeader.rawSize ) {
+		chunkHeader.compressedSize = chunkHeader.rawSize;
+		fwrite(&chunkHeader, sizeof(chunkHeader), 1, dumpFile);
+		fwrite(chunk->data, 1, chunk->size, dumpFile);
+	}
+	else {
+		fwrite(&chunkHeader, sizeof(chunkHeader), 1, dumpFile);
+		fwrite(compressed, 1, chunkHeader.compressedSize, dumpFile);
+	}
+}
+
+// a NULL chunk ends the writer
+static void runWriter (void)
+{
+	while ( 1 ) {
+		struct Chunk *chunk;
+		if ( !chunkQueue.pop(&chunk) ) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+
+		if ( chunk == NULL )
+			break;
+
+		writeChunk(chunk);
+		free(chunk);
+	}
+}
+
+// blocks ( yields ) while the writer is MSP_QUEUE_SIZE chunks behind
+static void pushChunk (struct Chunk *chunk)
+{
+	while ( !chunkQueue.push(chunk) )
+		std::this_thread::yield();
+}
+
+static void closeDumpFile (void)
+{
+	std::lock_guard<std::recursive_mutex> guard(dumpLock);
+
+	if ( writerThread ) {
+		if ( currentChunk && currentChunk->size != 0 )
+			pushChunk(currentChunk);
+		else
+			free(currentChunk);
+		currentChunk = NULL;
+
+		pushChunk(NULL);
+		writerThread->join();
+		delete writerThread;
+		writerThread = NULL;
+	}
+
+	if ( dumpFile ) {
+		fclose(dumpFile);
+		dumpFile = NULL;
+	}
+}
+
+static bool getEnvFlag (const char *name)
+{
+	const char *value = getenv(name);
+	return value && strcmp(value, "0") != 0;
+}
+
+static void openDumpFile (void)
+{
+	compressWrite = getEnvFlag("MSP_COMPRESS");
+	asyncWrite = compressWrite || getEnvFlag("MSP_ASYNC");
+
+	dumpFile = fopen(MSP_DUMP_FILE, "wb");
+	assert(dumpFile && "can not open memory dump file");
+	setvbuf(dumpFile, NULL, _IOFBF, MSP_BUFFER_SIZE);
+	atexit(closeDumpFile);
+
+	struct MSPFileHeader fileHeader = { MSP_MAGIC, MSP_VERSION };
+	if ( compressWrite )
+		fileHeader.version |= MSP_COMPRESSED;
+	fwrite(&fileHeader, sizeof(fileHeader), 1, dumpFile);
+
+	if ( asyncWrite )
+		writerThread = new std::thread(runWriter);
+}
+
+static void writeDump (const void *data, size_t size)
+{
+	if ( dumpFile == NULL )
+		openDumpFile();
+
+	if ( !asyncWrite ) {
+		fwrite(data, 1, size, dumpFile);
+		return;
+	}
+
+	const uint8_t *src = (const uint8_t *)data;
+	while ( size != 0 ) {
+		if ( currentChunk == NULL ) {
+			currentChunk = (struct Chunk *)malloc(sizeof(struct Chunk));
+			currentChunk->size = 0;
+		}
+
+		size_t length = MSP_CHUNK_SIZE - currentChunk->size;
+		if ( length > size )
+			length = size;
+
+		memcpy(currentChunk->data + currentChunk->size, src, length);
+		currentChunk->size += length;
+		src += length;
+		size -= length;
+
+		if ( currentChunk->size == MSP_CHUNK_SIZE ) {
+			pushChunk(currentChunk);
+			currentChunk = NULL;
+		}
+	}
+}
+
+static void writeRecordHeader (uint32_t tag, char *name)
+{
+	struct MSPRecordHeader recordHeader;
+	recordHeader.tag = tag;
+	recordHeader.nameLength = strlen(name);
+
+	writeDump(&recordHeader, sizeof(recordHeader));
+	writeDump(name, recordHeader.nameLength);
+}
+
+// struct layouts already in the file
+static std::vector<bool> layoutWritten;
+
+static void writeLayout (int id, char *name, int *layout)
+{
+	if ( id >= (int)layoutWritten.size() )
+		layoutWritten.resize(id + 1, false);
+	if ( layoutWritten[id] )
+		return;
+	layoutWritten[id] = true;
+
+	struct MSPLayoutHeader layoutHeader;
+	layoutHeader.id = id;
+	layoutHeader.stride = layout[0];
+	layoutHeader.pointerBytes = layout[1];
+	layoutHeader.numOfFields = layout[2];
+
+	writeRecordHeader(MSP_LAYOUT, name);
+	writeDump(&layoutHeader, sizeof(layoutHeader));
+	writeDump(&layout[3], layoutHeader.numOfFields * sizeof(struct MSPLayoutField));
+}
+
+extern "C"
+void dumpMemory (int id, char *name, void *src, int dataWidth, int numOfElements, long size,
+		int *layout)
+{
+	std::lock_guard<std::recursive_mutex> guard(dumpLock);
+
+	if ( layout != NULL )
+		writeLayout(id, name, layout);
+
+	struct MSPMemoryHeader memoryHeader;
+	memoryHeader.id = id;
+	memoryHeader.dataWidth = dataWidth;
+	memoryHeader.numOfElements = numOfElements;
+	memoryHeader.reserved = 0;
+	memoryHeader.size = size;
+
+	writeRecordHeader(MSP_MEMORY, name);
+	writeDump(&memoryHeader, sizeof(memoryHeader));
+	writeDump(src, size);
+}
+
+// Delta mode : a shadow copy per object id, only the blocks changed since
+// the previous snapshot are written. The first snapshot is a full image.
+struct Shadow {
+	uint8_t *image;
+	long size;
+};
+
+static std::vector<struct Shadow> id2shadow;
+
+extern "C"
+void dumpMemoryDelta (int id, char *name, void *src, int dataWidth, int numOfElements, long size,
+		int *layout)
+{
+	std::lock_guard<std::recursive_mutex> guard(dumpLock);
+
+	if ( id >= (int)id2shadow.size() ) {
+		struct Shadow empty = { NULL, 0 };
+		id2shadow.resize(id + 1, empty);
+	}
+
+	struct Shadow *shadow = &id2shadow[id];
+	uint8_t *cur = (uint8_t *)src;
+
+	if ( shadow->image == NULL || shadow->size != size ) {
+		free(shadow->image);
+		shadow->image = (uint8_t *)malloc(size);
+		shadow->size = size;
+		memcpy(shadow->image, cur, size);
+
+		dumpMemory(id, name, src, dataWidth, numOfElements, size, layout);
+		return;
+	}
+
+	// changed blocks, adjacent ones merged into a range
+	std::vector<struct MSPDeltaRange> ranges;
+	for ( long offset = 0; offset < size; offset += MSP_DELTA_BLOCK )
+	{
+		long length = size - offset < MSP_DELTA_BLOCK ? size - offset : MSP_DELTA_BLOCK;
+		if ( memcmp(shadow->image + offset, cur + offset, length) == 0 )
+			continue;
+
+		if ( !ranges.empty() && ranges.back().offset + ranges.back().length == (uint64_t)offset )
+			ranges.back().length += length;
+		else {
+			struct MSPDeltaRange range = { (uint64_t)offset, (uint64_t)length };
+			ranges.push_back(range);
+		}
+	}
+
+	struct MSPMemoryHeader memoryHeader;
+	memoryHeader.id = id;
+	memoryHeader.dataWidth = dataWidth;
+	memoryHeader.numOfElements = numOfElements;
+	memoryHeader.reserved = 0;
+	memoryHeader.size = size;
+
+	struct MSPDeltaHeader deltaHeader;
+	deltaHeader.numOfRanges = ranges.size();
+	deltaHeader.reserved = 0;
+
+	writeRecordHeader(MSP_DELTA, name);
+	writeDump(&memoryHeader, sizeof(memoryHeader));
+	writeDump(&deltaHeader, sizeof(deltaHeader));
+
+	for ( unsigned i = 0; i < ranges.size(); i++ )
+	{
+		writeDump(&ranges[i], sizeof(ranges[i]));
+		writeDump(cur + ranges[i].offset, ranges[i].length);
+		memcpy(shadow->image + ranges[i].offset, cur + ranges[i].offset, ranges[i].length);
+	}
+}
+
+extern "C"
+void dumpEnd (char *name)
+{
+	std::lock_guard<std::recursive_mutex> guard(dumpLock);
+
+	writeRecordHeader(MSP_FUNCTION_END, name);
+}
+
+// Store trace : each thread fills its own buffer without locking and
+// writes it as one record when it is full or the thread exits.
+static std::atomic<unsigned> numOfThreads(0);
+static std::vector<bool> namedObjects;
+
+struct TraceBuffer {
+	unsigned threadId;
+	unsigned numOfEntries;
+	struct MSPTraceEntry *entries;
+	std::vector<char *> id2name;
+
+	TraceBuffer() : threadId(numOfThreads++), numOfEntries(0) {
+		entries = (struct MSPTraceEntry *)malloc(MSP_TRACE_ENTRIES * sizeof(struct MSPTraceEntry));
+	}
+
+	~TraceBuffer() {
+		flush();
+		free(entries);
+	}
+
+	void flush() {
+		if ( numOfEntries == 0 )
+			return;
+
+		std::lock_guard<std::recursive_mutex> guard(dumpLock);
+
+		//names of the objects first seen in this chunk
+		for ( unsigned id = 0; id < id2name.size(); id++ )
+		{
+			if ( id2name[id] == NULL || (id < namedObjects.size() && namedObjects[id]) )
+				continue;
+			if ( id >= namedObjects.size() )
+				namedObjects.resize(id + 1, false);
+			namedObjects[id] = true;
+
+			struct MSPObjectHeader objectHeader = { id, 0 };
+			writeRecordHeader(MSP_OBJECT, id2name[id]);
+			writeDump(&objectHeader, sizeof(objectHeader));
+		}
+
+		struct MSPTraceHeader traceHeader = { threadId, numOfEntries };
+		char noName[] = "";
+		writeRecordHeader(MSP_STORE_TRACE, noName);
+		writeDump(&traceHeader, sizeof(traceHeader));
+		writeDump(entries, numOfEntries * sizeof(struct MSPTraceEntry));
+
+		numOfEntries = 0;
+	}
+};
+
+static thread_local TraceBuffer traceBuffer;
+
+// global memories of the program, emitted by the MemoryStatePrinter pass
+// and terminated by a NULL base ( empty when the pass did not emit it )
+struct MSPObject {
+	int id;
+	char *name;
+	char *base;
+	long size;
+};
+
+extern "C" struct MSPObject corelab_msp_objects[] __attribute__((weak)) = { { 0, NULL, NULL, 0 } };
+
+static bool objectBefore (const struct MSPObject *first, const struct MSPObject *second)
+{
+	return first->base < second->base;
+}
+
+// the object holding addr, NULL if none
+static const struct MSPObject *findObject (char *addr)
+{
+	static std::vector<const struct MSPObject *> objects = [] {
+		std::vector<const struct MSPObject *> sorted;
+		for ( int i = 0; corelab_msp_objects[i].base != NULL; i++ )
+			sorted.push_back(&corelab_msp_objects[i]);
+		std::sort(sorted.begin(), sorted.end(), objectBefore);
+		return sorted;
+	}();
+
+	struct MSPObject key = { 0, NULL, addr, 0 };
+	auto next = std::upper_bound(objects.begin(), objects.end(), &key, objectBefore);
+	if ( next == objects.begin() )
+		return NULL;
+
+	const struct MSPObject *object = *(next - 1);
+	return addr < object->base + object->size ? object : NULL;
+}
+
+extern "C"
+void traceStore (int id, char *name, void *base, void *addr, int width, uint64_t value)
+{
+	TraceBuffer &buffer = traceBuffer;
+
+	// several memories ( or none ) known at compile time : found by the address
+	if ( id == 0 ) {
+		if ( const struct MSPObject *object = findObject((char *)addr) ) {
+			id = object->id;
+			name = object->name;
+			base = object->base;
+		}
+	}
+
+	if ( id >= (int)buffer.id2name.size() )
+		buffer.id2name.resize(id + 1, NULL);
+	buffer.id2name[id] = name;
+
+	struct MSPTraceEntry *entry = &buffer.entries[buffer.numOfEntries];
+	entry->id = id;
+	entry->width = width;
+	entry->offset = (uint64_t)((char *)addr - (char *)base);
+	entry->value = value;
+
+	if ( ++buffer.numOfEntries == MSP_TRACE_ENTRIES )
+		buffer.flush();
+}
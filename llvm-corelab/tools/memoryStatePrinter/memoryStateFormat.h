@@ -0,0 +1,117 @@
+#ifndef CORELAB_MSP_FORMAT_H
+#define CORELAB_MSP_FORMAT_H
+#include <inttypes.h>
+
+// Binary memory state dump ( memory_state.bin )
+//
+// file   : MSPFileHeader, record*
+// record : MSPRecordHeader, name[nameLength], body
+//   MSP_FUNCTION_END : no body
+//   MSP_MEMORY       : MSPMemoryHeader, raw image[size]
+//   MSP_DELTA        : MSPMemoryHeader, MSPDeltaHeader,
+//                      ( MSPDeltaRange, bytes[length] ) * numOfRanges
+//                      changes from the previous image of the same id
+//   MSP_OBJECT       : MSPObjectHeader, names a traced object id
+//   MSP_STORE_TRACE  : MSPTraceHeader, MSPTraceEntry * numOfEntries
+//                      stores of one thread in program order
+//   MSP_LAYOUT       : MSPLayoutHeader, MSPLayoutField * numOfFields
+//                      scalars of a struct memory id, before its first image
+//
+// compressed file ( version | MSP_COMPRESSED ) : MSPFileHeader, chunk*
+// chunk  : MSPChunkHeader, data[compressedSize], the records above split
+//          into MSP_CHUNK_SIZE pieces ( compressedSize == rawSize : stored )
+
+#define MSP_DUMP_FILE "memory_state.bin"
+#define MSP_MAGIC 0x534d4c43 // "CLMS"
+#define MSP_VERSION 1
+#define MSP_COMPRESSED 0x80000000
+
+enum MSPRecordTag {
+	MSP_FUNCTION_END = 1,
+	MSP_MEMORY = 2,
+	MSP_DELTA = 3,
+	MSP_OBJECT = 4,
+	MSP_STORE_TRACE = 5,
+	MSP_LAYOUT = 6
+};
+
+// width of a pointer field / stored pointer, as in printBits
+#define MSP_POINTER_WIDTH 2
+
+// granularity of the comparison against the shadow copy
+#define MSP_DELTA_BLOCK 64
+
+// piece of the record stream handed to the writer thread
+#define MSP_CHUNK_SIZE (1 << 20)
+
+// stores buffered per thread before a trace record is written
+#define MSP_TRACE_ENTRIES 65536
+
+struct MSPFileHeader {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct MSPRecordHeader {
+	uint32_t tag;
+	uint32_t nameLength;
+};
+
+struct MSPMemoryHeader {
+	uint32_t id;
+	uint32_t dataWidth;
+	uint32_t numOfElements;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+struct MSPDeltaHeader {
+	uint32_t numOfRanges;
+	uint32_t reserved;
+};
+
+struct MSPDeltaRange {
+	uint64_t offset;
+	uint64_t length;
+};
+
+// the image is a sequence of stride bytes units ( array of struct ),
+// each holding the same fields
+struct MSPLayoutHeader {
+	uint32_t id;
+	uint32_t stride;
+	uint32_t pointerBytes;
+	uint32_t numOfFields;
+};
+
+// byte offset in the unit and width in bits ( MSP_POINTER_WIDTH : pointer )
+struct MSPLayoutField {
+	uint32_t offset;
+	uint32_t width;
+};
+
+struct MSPObjectHeader {
+	uint32_t id;
+	uint32_t reserved;
+};
+
+struct MSPTraceHeader {
+	uint32_t threadId;
+	uint32_t numOfEntries;
+};
+
+// id 0 : the address is in no known object, offset is the address
+// width MSP_POINTER_WIDTH : a pointer was stored
+struct MSPTraceEntry {
+	uint32_t id;
+	uint32_t width;
+	uint64_t offset;
+	uint64_t value;
+};
+
+struct MSPChunkHeader {
+	uint32_t rawSize;
+	uint32_t compressedSize;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef CORELAB_MSP_LZ_H
+#define CORELAB_MSP_LZ_H
+#include <inttypes.h>
+#include <string.h>
+
+// LZ4 style block compression of dump chunks.
+//
+// sequence : token, [ literal length ], literals, [ offset(2), [ match length ] ]
+//   token high 4 bits : literal length ( 15 : more bytes follow, 255 : continue )
+//   token low 4 bits  : match length - 4 ( same encoding )
+// the last sequence of a block has literals only.
+
+#define MSP_LZ_MIN_MATCH 4
+#define MSP_LZ_HASH_BITS 14
+#define MSP_LZ_MAX_OFFSET 0xFFFF
+
+// worst case output of mspCompress
+#define MSP_LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+static inline uint8_t *mspWriteLength (uint8_t *out, size_t length)
+{
+	for ( ; length >= 255; length -= 255 )
+		*out++ = 255;
+	*out++ = (uint8_t)length;
+	return out;
+}
+
+static inline uint8_t *mspEmitSequence (uint8_t *out, const uint8_t *literals, size_t numOfLiterals,
+		size_t offset, size_t matchLength)
+{
+	size_t extraMatch = matchLength ? matchLength - MSP_LZ_MIN_MATCH : 0;
+	uint8_t *token = out++;
+
+	*token = (uint8_t)((numOfLiterals < 15 ? numOfLiterals : 15) << 4);
+	if ( numOfLiterals >= 15 )
+		out = mspWriteLength(out, numOfLiterals - 15);
+
+	memcpy(out, literals, numOfLiterals);
+	out += numOfLiterals;
+
+	if ( matchLength == 0 )
+		return out;
+
+	*token |= (uint8_t)(extraMatch < 15 ? extraMatch : 15);
+	*out++ = (uint8_t)(offset & 0xFF);
+	*out++ = (uint8_t)(offset >> 8);
+	if ( extraMatch >= 15 )
+		out = mspWriteLength(out, extraMatch - 15);
+
+	return out;
+}
+
+// dst must hold MSP_LZ_BOUND(size) bytes, returns the compressed size
+static inline size_t mspCompress (const uint8_t *src, size_t size, uint8_t *dst)
+{
+	static uint32_t table[1 << MSP_LZ_HASH_BITS]; // position + 1 of the last 4 bytes seen
+	memset(table, 0, sizeof(table));
+
+	uint8_t *out = dst;
+	size_t anchor = 0;
+	size_t pos = 0;
+
+	while ( pos + MSP_LZ_MIN_MATCH <= size ) {
+		uint32_t sequence;
+		memcpy(&sequence, src + pos, sizeof(sequence));
+		uint32_t hash = (sequence * 2654435761u) >> (32 - MSP_LZ_HASH_BITS);
+
+		size_t candidate = table[hash];
+		table[hash] = (uint32_t)(pos + 1);
+
+		if ( candidate == 0 || pos - (candidate - 1) > MSP_LZ_MAX_OFFSET
+				|| memcmp(src + candidate - 1, src + pos, MSP_LZ_MIN_MATCH) != 0 ) {
+			pos++;
+			continue;
+		}
+
+		size_t ref = candidate - 1;
+		size_t length = MSP_LZ_MIN_MATCH;
+		while ( pos + length < size && src[ref + length] == src[pos + length] )
+			length++;
+
+		out = mspEmitSequence(out, src + anchor, pos - anchor, pos - ref, length);
+		pos += length;
+		anchor = pos;
+	}
+
+	out = mspEmitSequence(out, src + anchor, size - anchor, 0, 0);
+	return out - dst;
+}
+
+static inline bool mspReadLength (const uint8_t **in, const uint8_t *end, size_t *length)
+{
+	uint8_t byte;
+	do {
+		if ( *in >= end )
+			return false;
+		byte = *(*in)++;
+		*length += byte;
+	} while ( byte == 255 );
+	return true;
+}
+
+// returns false on a malformed block or when dst ( rawSize bytes ) would overflow
+static inline bool mspDecompress (const uint8_t *src, size_t size, uint8_t *dst, size_t rawSize)
+{
+	const uint8_t *in = src;
+	const uint8_t *end = src + size;
+	size_t pos = 0;
+
+	while ( in < end ) {
+		uint8_t token = *in++;
+
+		size_t numOfLiterals = token >> 4;
+		if ( numOfLiterals == 15 && !mspReadLength(&in, end, &numOfLiterals) )
+			return false;
+		if ( (size_t)(end - in) < numOfLiterals || pos + numOfLiterals > rawSize )
+			return false;
+
+		memcpy(dst + pos, in, numOfLiterals);
+		in += numOfLiterals;
+		pos += numOfLiterals;
+
+		if ( in == end )
+			break;
+
+		if ( end - in < 2 )
+			return false;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		size_t matchLength = token & 0xF;
+		if ( matchLength == 15 && !mspReadLength(&in, end, &matchLength) )
+			return false;
+		matchLength += MSP_LZ_MIN_MATCH;
+
+		if ( offset == 0 || offset > pos || pos + matchLength > rawSize )
+			return false;
+
+		// byte by byte, a match may overlap its own output
+		for ( size_t i = 0; i < matchLength; i++, pos++ )
+			dst[pos] = dst[pos - offset];
+	}
+
+	return pos == rawSize;
+}
+
+#endif
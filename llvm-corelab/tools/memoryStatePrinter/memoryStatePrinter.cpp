@@ -4,15 +4,13 @@
 
 #include "memoryStatePrinter.h"
 
-#include <map>
-
 #define MASK16 0x00FF
 #define MASK32 0x000000FF
 #define MASK64 0x00000000000000FF
 
-std::map<int, int *> id2struct;
-
-static int offset;
+// layout of each struct memory, emitted by the MemoryStatePrinter pass
+// as ( width, num ) pairs terminated by 0 ( a leading 0, 0 : array of struct )
+extern "C" int *corelab_msp_struct_layouts[] __attribute__((weak));
 
 extern "C" 
 void printBits (int dataWidth, char *name, void *src, int numOfElements, int memBitWidth,
@@ -23,7 +21,7 @@ void printBits (int dataWidth, char *name, void *src, int numOfElements, int mem
 	fprintf(stderr, "%s\n", name);
 
 	if ( isStruct && memBitWidth == 0 ) { // struct without memoryblock
-		int *obj = id2struct[id];
+		int *obj = corelab_msp_struct_layouts[id];
 		if ( obj[0] != 0 ) { // not array of struct
 			// the dataWidth is the maximum dataWidth
 			for ( i=0; obj[i] != 0; )
@@ -179,7 +177,7 @@ void printBits (int dataWidth, char *name, void *src, int numOfElements, int mem
 
 		int accumulatedBits = 0;
 
-		int *obj = id2struct[id];
+		int *obj = corelab_msp_struct_layouts[id];
 
 		if ( obj[0] != 0 ) { // not array of struct
 
@@ -415,27 +413,3 @@ void printEnd (char *name)
 {
 	fprintf(stderr, "Function %s End\n\n", name);
 }
-
-extern "C" 
-void registerStruct (int id)
-{
-	int *obj = (int *)malloc( 1000 * sizeof(int) );
-	id2struct[id] = obj;
-}
-
-extern "C" 
-void startStruct (void)
-{
-	offset = 0;
-}
-
-extern "C" 
-void addElement (int id, int dataWidth, int num)
-{
-	int *obj = id2struct[id];
-	obj[offset] = dataWidth;
-	offset++;
-	obj[offset] = num;
-	offset++;
-}
-
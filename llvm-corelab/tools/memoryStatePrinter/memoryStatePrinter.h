@@ -8,10 +8,17 @@ extern "C" void printBits (int type, char *name, void *src, int size, int memBit
 
 extern "C" void printEnd (char *name);
 
-extern "C" void registerStruct (int id);
+// binary dump mode ( memoryStateDump.cpp )
+// layout : NULL, or stride, pointer bytes, number of fields, ( offset, width ) *
+extern "C" void dumpMemory (int id, char *name, void *src, int dataWidth, int numOfElements,
+													long size, int *layout);
 
-extern "C" void startStruct (void);
+extern "C" void dumpMemoryDelta (int id, char *name, void *src, int dataWidth,
+													int numOfElements, long size, int *layout);
 
-extern "C" void addElement (int id, int dataWidth, int num);
+extern "C" void dumpEnd (char *name);
+
+extern "C" void traceStore (int id, char *name, void *base, void *addr, int width,
+													uint64_t value);
 
 #endif